@@ -33,7 +33,9 @@ http://github.com/TroZ/DF2MC
 #include <string.h>
 #include <string>
 #include <vector>
+#include <new>
 #include <map>
+#include <set>
 #include <hash_set>
 #include <stdio.h>
 #include <algorithm>
@@ -41,9 +43,11 @@ http://github.com/TroZ/DF2MC
 #include <stdint.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdarg.h>
 
 #include "Console.h"
 #include "Core.h"
+#include "tinythread.h"
 #include "Export.h"
 #include "PluginManager.h"
 #include <TileTypes.h>
@@ -77,10 +81,46 @@ http://github.com/TroZ/DF2MC
 
 #if _MSC_VER
     #define snprintf _snprintf
+    #define vsnprintf _vsnprintf
     #include <io.h>
     #include <direct.h>
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#endif
+
+//SIMD kernels - SSE2 on x86 (always there on x86-64), AVX2 where the compiler supports it, both checked for at run time
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+        #include <emmintrin.h>
+        #define USE_SSE2
+        #define TARGET_SSE2
+        #if _MSC_VER >= 1700
+            #include <immintrin.h>
+            #define USE_AVX2
+            #define TARGET_AVX2
+        #endif
+    #elif defined(__GNUC__) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) )
+        #include <immintrin.h>
+        #define USE_SSE2
+        #define USE_AVX2
+        #define TARGET_SSE2 __attribute__ ( ( target ( "sse2" ) ) )
+        #define TARGET_AVX2 __attribute__ ( ( target ( "avx2" ) ) )
+    #elif defined(__GNUC__) && ( defined(__x86_64__) || defined(__SSE2__) )
+        //older GCC can't pick instruction sets per function, but SSE2 is part of x86-64 (or was asked for with -msse2)
+        #include <emmintrin.h>
+        #define USE_SSE2
+        #define SSE2_BASELINE
+        #define TARGET_SSE2
+    #endif
 #endif
 #ifdef LINUX_BUILD
+    #include <sys/time.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
     #include <strings.h>
     #define stricmp strcasecmp
     #define strnicmp strncasecmp
@@ -127,14 +167,16 @@ std::map<std::string,uint8_t*> plants;  //object description string to minecraft
 std::map<std::string,uint8_t*> buildings;   //object description string to minecraft material array of size 2 * squaresize * squaresize * squaresize; 0 is material, 1 is data
 std::map<std::string,uint8_t*> flows;   //object description string to minecraft material array of size 2 * squaresize * squaresize * squaresize; 0 is material, 1 is data
 std::map<std::string,std::string> buildingNeighbors; //the buildings (second) to align a build (first) to face
-std::hash_set<int> sandhash;                //list of objects that respond to gravity (sand)
-std::hash_set<int> supporthash;             //list of objects that don't support thing that respond to gravity (water, lava, etc)
+uint8_t sandTable[256];                     //objects that respond to gravity (sand)
+uint8_t nonSupportTable[256];               //objects that don't support thing that respond to gravity (water, lava, etc)
 
 int cubeSkyOpacity[256];//how much light each block absorbes from the sky
 int cubeBlockOpacity[256];//how much light each block absorbes from the block sources
 int cubePartialLit[256];//if the block is partially light - mostly 1/2 step and stais blocks, that are lit themselves but block light from passing through
 
-#define CHUNK_HEIGHT 128
+#define CHUNK_HEIGHT 128    //Alpha and McRegion chunks
+#define ANVIL_HEIGHT 256    //Anvil chunks, in 16 high sections
+int maxHeight = CHUNK_HEIGHT;//for the output type being used
 
 TiXmlElement *settings;
 TiXmlElement *materialmapping;
@@ -225,6 +267,127 @@ struct myConstruction
     uint32_t mat_idx;
 };
 
+struct myVein
+{
+    int32_t inorganic_mat;
+    uint16_t tile_bitmask[16];
+};
+
+struct mySpatter
+{
+    int16_t mat_type;
+    uint8_t amount[16][16];
+};
+
+//copy of everything convertDFBlock needs from a single DF map block
+struct myBlock
+{
+    DFHack::mapblock40d block;
+    std::vector<myVein> veins;
+    std::vector<mySpatter> splatter;
+    DFHack::t_feature local;
+    DFHack::t_feature global;
+};
+
+//copy of the DF map taken while the game is suspended, so conversion, lighting and saving
+//can run after Dwarf Fortress has been allowed to continue
+struct mySnapshot
+{
+    uint32_t mapx,mapy,mapz;        //full map size in blocks
+    uint32_t x_max,y_max,z_max;     //limited output area in blocks
+    uint32_t xoffset,yoffset;
+    std::vector<myBlock*> blocks;   //mapx*mapy*mapz, NULL if not copied or not in DF
+    vector< vector <uint16_t> > layerassign;
+    map<uint32_t,myConstruction> constructions;
+    map<uint32_t,myBuilding> buildings;
+    map<uint32_t,int16_t> vegs;     //plant raw index
+    std::vector<std::string> inorganics;    //ids of world->raws
+    std::vector<std::string> plants;
+    std::vector<std::string> creatures;
+    int32_t cursorx,cursory,cursorz;
+
+    mySnapshot() : mapx ( 0 ),mapy ( 0 ),mapz ( 0 ),x_max ( 0 ),y_max ( 0 ),z_max ( 0 ),xoffset ( 0 ),yoffset ( 0 ),cursorx ( -30000 ),cursory ( -30000 ),cursorz ( -30000 ) {}
+    ~mySnapshot()
+    {
+        for ( size_t i=0;i<blocks.size();i++ )
+            delete blocks[i];
+    }
+
+    myBlock* getBlock ( int32_t x,int32_t y,int32_t z ) const
+    {
+        if ( x<0 || y<0 || z<0 || x>= ( int32_t ) mapx || y>= ( int32_t ) mapy || z>= ( int32_t ) mapz )
+            return NULL;
+        return blocks[ ( z*mapy + y ) *mapx + x];
+    }
+};
+
+//the block being converted and its 8 neighbours, looked up once per block
+//so the neighbour checks for ramps, walls and buildings don't have to find them per tile
+struct myBlockWindow
+{
+    const DFHack::mapblock40d *blocks[3][3];   //[x][y], [1][1] is the block being converted
+    int32_t basex,basey;                        //DF square of the top left corner of blocks[0][0]
+
+    void load ( const mySnapshot &snap, int32_t bx, int32_t by, int32_t z )
+    {
+        basex = ( bx-1 ) * ( int32_t ) SQUARESPERBLOCK;
+        basey = ( by-1 ) * ( int32_t ) SQUARESPERBLOCK;
+        for ( int x=0;x<3;x++ )
+        {
+            for ( int y=0;y<3;y++ )
+            {
+                myBlock *B = snap.getBlock ( bx+x-1,by+y-1,z );
+                blocks[x][y] = ( B!=NULL ) ? &B->block : NULL;
+            }
+        }
+    }
+
+    //tile type at a DF square next to (or in) the centre block, false if that square isn't in the map
+    bool getTile ( int32_t x,int32_t y,df::tiletype &tt ) const
+    {
+        int32_t wx = x-basex;
+        int32_t wy = y-basey;
+        if ( wx<0 || wy<0 || wx>= 3* ( int32_t ) SQUARESPERBLOCK || wy>= 3* ( int32_t ) SQUARESPERBLOCK )
+            return false;
+        const DFHack::mapblock40d *Block = blocks[wx/SQUARESPERBLOCK][wy/SQUARESPERBLOCK];
+        if ( Block==NULL )
+            return false;
+        tt = Block->tiletypes[wx%SQUARESPERBLOCK][wy%SQUARESPERBLOCK];
+        return true;
+    }
+
+    //neighbouring wall/fortification mask (see DIR_CARDINALS) for every square of the centre block
+    void wallMasks ( uint8_t masks[16][16] ) const
+    {
+        //one row of bits per line of squares, including the line on each side of the block
+        uint32_t rows[18];
+        df::tiletype tt;
+        for ( int r=0;r<18;r++ )
+        {
+            rows[r]=0;
+            for ( int c=0;c<18;c++ )
+            {
+                if ( getTile ( basex+SQUARESPERBLOCK+c-1,basey+SQUARESPERBLOCK+r-1,tt ) )
+                {
+                    df::tiletype_shape ts = tileShape(tt);
+                    if ( ts == tiletype_shape::WALL || ts == tiletype_shape::FORTIFICATION )
+                        rows[r] |= 1<<c;
+                }
+            }
+        }
+        for ( int x=0;x<16;x++ )
+        {
+            for ( int y=0;y<16;y++ )
+            {
+                masks[x][y] = ( uint8_t ) ( ( ( rows[y]>>x ) &7 ) |
+                                            ( ( ( rows[y+1]>>x ) &1 ) <<3 ) |
+                                            ( ( ( rows[y+1]>> ( x+2 ) ) &1 ) <<4 ) |
+                                            ( ( ( rows[y+2]>>x ) &7 ) <<5 ) );
+            }
+        }
+    }
+};
+
 
 char *airarray=NULL;
 char *intarray=NULL;
@@ -241,7 +404,7 @@ int squaresize=3;//number of minecraft blocks per DF square
 int torchPerInside = 10;
 int torchPerDark = 20;
 int torchPerSubter = 30;
-int directionalWalls = 0;
+int directionalWalls = 1;
 int safesand = 3;
 
 uint32_t limitxmin = 0;
@@ -258,6 +421,48 @@ int64_t seed = 0x004446746F4D43FF;// DFtoMC
 
 int biome = 0; //for now = 0 is normal, 1 is snow
 int snowy = 0;
+int background = 1;//release DF after the map is copied and finish the export on a worker thread
+int numThreads = 0;//worker threads for conversion, 0 is one per core
+
+//saved world format, picked with <output type="...">
+#define OUTPUT_ALPHA        0   //one gzipped file per chunk in base36 directories
+#define OUTPUT_MCREGION     1   //32x32 chunks per region file, Beta 1.3 onwards
+#define OUTPUT_ANVIL        2   //region files of 16 high chunk sections, Minecraft 1.2 onwards
+#define MCREGION_VERSION    19132
+#define ANVIL_VERSION       19133
+int outputType = OUTPUT_ALPHA;
+
+//zlib settings for the saved files, picked with <output compression="...">
+struct myCompression
+{
+    const char *name;
+    int level;
+    int strategy;
+};
+myCompression compressionProfiles[] =
+{
+    {"fastest",  1,                  Z_RLE},            //run length only, the world is mostly long runs of air and stone
+    {"balanced", 6,                  Z_DEFAULT_STRATEGY},
+    {"archival", Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY},
+    {NULL,       0,                  0}
+};
+const myCompression *compression = &compressionProfiles[2];
+
+tthread::thread *exportThread = NULL;
+bool exportRunning = false;     //set by mc_export, cleared by the export thread, only touched under exportLock
+tthread::fast_mutex exportLock;
+
+bool isExportRunning()
+{
+    tthread::lock_guard<tthread::fast_mutex> guard ( exportLock );
+    return exportRunning;
+}
+
+void setExportRunning ( bool running )
+{
+    tthread::lock_guard<tthread::fast_mutex> guard ( exportLock );
+    exportRunning = running;
+}
 
 //stats counters
 #define UNKNOWN     0
@@ -273,11 +478,390 @@ int snowy = 0;
 #define BUILDINGS   4
 int stats[STAT_AREAS][STAT_TYPES];
 
+//export timings, wall and CPU time for each phase so a slower export can be traced to the part that slowed down
+#define PHASE_SETTINGS      0
+#define PHASE_LEVELS        1
+#define PHASE_GEOLOGY       2
+#define PHASE_PLANTS        3
+#define PHASE_CONSTRUCTIONS 4
+#define PHASE_BLOCKS        5
+#define PHASE_RESOLVE       6
+#define PHASE_CONVERT       7
+#define PHASE_LIGHT         8
+#define PHASE_PACK          9
+#define PHASE_COMPRESS      10
+#define PHASE_WRITE         11
+#define PHASES              12
+const char *phaseNames[PHASES] = { "settings load","level scan","geology read","plant read","construction read","map block read",
+                                   "material resolve","conversion","lighting","chunk packing","compression","file I/O"
+                                 };
+
+struct myPhaseTime
+{
+    int64_t wall;   //microseconds
+    int64_t cpu;    //microseconds, over every thread that worked on it
+    int64_t count;  //what was done - tiles for a level, chunks for packing, files for I/O
+
+    void add ( const myPhaseTime &t )
+    {
+        wall += t.wall;
+        cpu += t.cpu;
+        count += t.count;
+    }
+};
+
+struct myExportStats
+{
+    myPhaseTime phases[PHASES];
+    std::vector<myPhaseTime> levels;    //conversion of each DF z-level, added up over the bands
+    int64_t start;
+    int64_t tiles;      //DF tiles converted
+    int64_t voxels;     //MC blocks they were turned into
+    int64_t bytes;      //written to disk, every file included
+    int64_t helperCpu;  //CPU time of the extra parallelFor workers, picked up by whichever phase started them
+};
+myExportStats exportStats;
+
+struct myUnknown
+{
+    TiXmlElement *section;
+    std::string name;
+    std::string data;
+    bool hasdata;
+    int stattype;
+};
+
+//the outcome of looking up a material in dfMats
+struct myMatResult
+{
+    uint8_t *material;  //NULL if not found
+    int outcome;        //PERFECT, IMPERFECT or UNKNOWN
+    bool local;         //found in materials created while converting the current block
+    std::string best;   //most specific name for the material, for hack/unimplementedobjects.xml
+    std::string basic;  //basic material name, created as air if nothing is found
+};
+
+int dfMatsGeneration = 0;//changed every time materials are added to dfMats
+
+struct myMatCacheEntry
+{
+    bool used;
+    uint32_t hash;
+    int variant;
+    int flags;  //which of the optional names were given
+    std::string basic,full,spec,cons;
+    myMatResult result;
+};
+
+//remembers getMaterial lookups, the same few combinations of names come up over and over again
+//one cache per conversion thread, emptied whenever dfMats changes
+struct myMaterialCache
+{
+    std::vector<myMatCacheEntry> entries;   //open addressing, size is a power of 2
+    size_t count;
+    int generation;
+    double hits;
+    double misses;
+
+    myMaterialCache() : count ( 0 ),generation ( dfMatsGeneration ),hits ( 0 ),misses ( 0 )
+    {
+        entries.resize ( 1024 );
+        clear();
+    }
+
+    void clear()
+    {
+        for ( size_t i=0;i<entries.size();i++ )
+            entries[i].used = false;
+        count = 0;
+        generation = dfMatsGeneration;
+    }
+
+    static int getFlags ( const char* full,const char* spec,const char* cons )
+    {
+        return ( full!=NULL ? 1 : 0 ) | ( spec!=NULL ? 2 : 0 ) | ( cons!=NULL ? 4 : 0 );
+    }
+
+    static uint32_t hashName ( uint32_t h,const char* str )
+    {
+        //FNV-1a
+        if ( str!=NULL )
+        {
+            while ( *str!='\0' )
+            {
+                h ^= ( uint8_t ) *str;
+                h *= 16777619;
+                str++;
+            }
+        }
+        h ^= 0xff;
+        h *= 16777619;
+        return h;
+    }
+
+    static uint32_t hashKey ( const char* basic,int variant,const char* full,const char* spec,const char* cons )
+    {
+        uint32_t h = 2166136261U;
+        h = hashName ( h,basic );
+        h = hashName ( h,full );
+        h = hashName ( h,spec );
+        h = hashName ( h,cons );
+        h ^= ( uint32_t ) variant;
+        h *= 16777619;
+        h ^= ( uint32_t ) getFlags ( full,spec,cons );
+        h *= 16777619;
+        return h;
+    }
+
+    const myMatResult* find ( uint32_t hash,const char* basic,int variant,const char* full,const char* spec,const char* cons )
+    {
+        if ( generation != dfMatsGeneration )
+            clear();
+
+        int flags = getFlags ( full,spec,cons );
+        size_t mask = entries.size()-1;
+        for ( size_t i=hash&mask; entries[i].used; i= ( i+1 ) &mask )
+        {
+            myMatCacheEntry &e = entries[i];
+            if ( e.hash==hash && e.variant==variant && e.flags==flags && e.basic==basic &&
+                    ( full==NULL || e.full==full ) && ( spec==NULL || e.spec==spec ) && ( cons==NULL || e.cons==cons ) )
+            {
+                hits++;
+                return &e.result;
+            }
+        }
+        misses++;
+        return NULL;
+    }
+
+    void insert ( uint32_t hash,const char* basic,int variant,const char* full,const char* spec,const char* cons,const myMatResult &result )
+    {
+        if ( ( count+1 ) *2 > entries.size() )
+        {
+            //grow and rehash
+            std::vector<myMatCacheEntry> old;
+            old.swap ( entries );
+            entries.resize ( old.size() *2 );
+            count = 0;
+            for ( size_t i=0;i<entries.size();i++ )
+                entries[i].used = false;
+            size_t mask = entries.size()-1;
+            for ( size_t i=0;i<old.size();i++ )
+            {
+                if ( !old[i].used )
+                    continue;
+                size_t j=old[i].hash&mask;
+                while ( entries[j].used )
+                    j= ( j+1 ) &mask;
+                entries[j] = old[i];
+                count++;
+            }
+        }
+
+        size_t mask = entries.size()-1;
+        size_t i=hash&mask;
+        while ( entries[i].used )
+            i= ( i+1 ) &mask;
+        myMatCacheEntry &e = entries[i];
+        e.used = true;
+        e.hash = hash;
+        e.variant = variant;
+        e.flags = getFlags ( full,spec,cons );
+        e.basic = basic;
+        e.full = full!=NULL ? full : "";
+        e.spec = spec!=NULL ? spec : "";
+        e.cons = cons!=NULL ? cons : "";
+        e.result = result;
+        count++;
+    }
+};
+
+//the outcome of looking up a plant shape
+struct myShapeResult
+{
+    uint8_t *shape;
+    int outcome;        //PERFECT, IMPERFECT or UNKNOWN
+};
+
+struct myResolvedMats;
+
+//objects made of a shape filled in with a material, built once for each combination
+//one cache per conversion thread, the memory belongs to the export and is freed when it's done
+struct myObjectCache
+{
+    struct entry
+    {
+        const uint8_t *shape;
+        const uint8_t *mat;
+        uint8_t *object;
+    };
+    std::vector<entry> entries;     //open addressing, size is a power of 2
+    size_t count;
+    std::vector<uint8_t*> chunks;   //arena the objects are stored in
+    size_t chunkUsed;
+    size_t chunkSize;
+    uint8_t *airObject;
+    int generation;
+    double hits;
+    double built;
+    size_t bytes;
+
+    myObjectCache() : count ( 0 ),chunkUsed ( 0 ),chunkSize ( 0 ),airObject ( NULL ),generation ( dfMatsGeneration ),hits ( 0 ),built ( 0 ),bytes ( 0 )
+    {
+        entry empty = { NULL,NULL,NULL };
+        entries.resize ( 256,empty );
+    }
+
+    ~myObjectCache()
+    {
+        for ( size_t i=0;i<chunks.size();i++ )
+            delete[] chunks[i];
+    }
+
+    uint8_t* allocate ( size_t size )
+    {
+        if ( chunks.empty() || chunkUsed+size>chunkSize )
+        {
+            chunkSize = max ( ( size_t ) 64*1024,size );
+            chunks.push_back ( new uint8_t[chunkSize] );
+            chunkUsed = 0;
+            bytes += chunkSize;
+        }
+        uint8_t *ptr = chunks.back() +chunkUsed;
+        chunkUsed += size;
+        return ptr;
+    }
+
+    static size_t hashKey ( const uint8_t *shape,const uint8_t *mat )
+    {
+        size_t h = ( size_t ) shape * 31 + ( size_t ) mat;
+        return h ^ ( h>>7 ) ^ ( h>>17 );
+    }
+
+    uint8_t* find ( const uint8_t *shape,const uint8_t *mat )
+    {
+        if ( generation != dfMatsGeneration )
+        {
+            //materials may have been freed and their addresses reused, forget the objects (the arena keeps them)
+            entry empty = { NULL,NULL,NULL };
+            entries.assign ( entries.size(),empty );
+            count = 0;
+            generation = dfMatsGeneration;
+        }
+        size_t mask = entries.size()-1;
+        for ( size_t i=hashKey ( shape,mat ) &mask; entries[i].object!=NULL; i= ( i+1 ) &mask )
+        {
+            if ( entries[i].shape==shape && entries[i].mat==mat )
+            {
+                hits++;
+                return entries[i].object;
+            }
+        }
+        return NULL;
+    }
+
+    //puts an entry in a free slot, the table must have room
+    void place ( const uint8_t *shape,const uint8_t *mat,uint8_t *object )
+    {
+        size_t mask = entries.size()-1;
+        size_t i=hashKey ( shape,mat ) &mask;
+        while ( entries[i].object!=NULL )
+            i= ( i+1 ) &mask;
+        entries[i].shape = shape;
+        entries[i].mat = mat;
+        entries[i].object = object;
+        count++;
+    }
+
+    void insert ( const uint8_t *shape,const uint8_t *mat,uint8_t *object )
+    {
+        if ( ( count+1 ) *2 > entries.size() )
+        {
+            std::vector<entry> old;
+            old.swap ( entries );
+            entry empty = { NULL,NULL,NULL };
+            entries.resize ( old.size() *2,empty );
+            count = 0;
+            for ( size_t i=0;i<old.size();i++ )
+            {
+                if ( old[i].object!=NULL )
+                    place ( old[i].shape,old[i].mat,old[i].object );
+            }
+        }
+        place ( shape,mat,object );
+        built++;
+    }
+};
+
+//a material lookup that found nothing at all, so the merge can tell if an earlier block on the level created the
+//material meanwhile - converting the blocks one at a time, this lookup would have found it
+struct myMissingMat
+{
+    std::string basic;
+    bool perfect;       //the lookup was for the basic material itself
+    bool addstats;
+    int message;        //the NOT FOUND line in messages, -1 if there wasn't one
+    int unknown;        //its entry in unknowns
+};
+
+//everything converting one DF block changes besides its own part of the MC arrays
+//blocks can be converted on any thread, these are merged back in block order afterwards
+struct myConvertContext
+{
+    int stats[STAT_AREAS][STAT_TYPES];
+    std::vector<myUnknown> unknowns;                //for hack/unimplementedobjects.xml
+    std::map<std::string,uint8_t*> newMats;         //basic materials that had to be created as air
+    std::vector<myMissingMat> missing;              //lookups that found nothing
+    std::vector<std::pair<bool,std::string> > messages; //console output, true if an error
+    int biome;
+    myMaterialCache *matCache;                      //of the thread converting the block, may be NULL
+    const myResolvedMats *resolved;                 //may be NULL
+    myObjectCache *objCache;                        //of the thread converting the block, may be NULL
+
+    myConvertContext() : biome ( 0 ),matCache ( NULL ),resolved ( NULL ),objCache ( NULL )
+    {
+        memset ( stats,0,sizeof ( stats ) );
+    }
+};
+
+#define PLANT_SHAPES    4   //tree, sapling, shrub and treetop
+
+//materials and plant shapes worked out for every raw before the map is converted,
+//so most tiles find theirs by index instead of by name
+struct myResolvedMats
+{
+    std::vector<int> rowOf;                 //tiletype to row of mats, -1 if not resolved
+    size_t columns;                         //number of inorganics + 1, column 0 is no material
+    std::vector<myMatResult> mats;          //for soil, stone and feature tiles
+    std::vector<myShapeResult> plantShapes; //PLANT_SHAPES for each plant raw
+
+    myResolvedMats() : columns ( 0 ) {}
+
+    const myMatResult* getMat ( int tiletype,int inorganic ) const
+    {
+        if ( tiletype<0 || tiletype>= ( int ) rowOf.size() || rowOf[tiletype]<0 || inorganic+1>= ( int ) columns )
+            return NULL;
+        const myMatResult &res = mats[rowOf[tiletype]*columns + inorganic+1];
+        //missing materials are left to getMaterial to create
+        return res.outcome==UNKNOWN ? NULL : &res;
+    }
+
+    const myShapeResult* getPlantShape ( int slot,int plant ) const
+    {
+        if ( plant<0 || ( size_t ) plant*PLANT_SHAPES>=plantShapes.size() )
+            return NULL;
+        return &plantShapes[plant*PLANT_SHAPES + slot];
+    }
+};
+
 void loadMcMats ( TiXmlDocument* doc, color_ostream & out )
 {
 
     out.print ( "Loading Minecraft Materials...\n" );
 
+    memset ( sandTable,0,sizeof ( sandTable ) );
+    memset ( nonSupportTable,0,sizeof ( nonSupportTable ) );
+
     char* tagname = "minecraftmaterialsalpha";
     TiXmlElement *elm = doc->FirstChildElement();
     while ( elm!=NULL )
@@ -324,12 +908,12 @@ void loadMcMats ( TiXmlDocument* doc, color_ostream & out )
 
                         if ( mat->Attribute ( "sand",&opacity ) !=NULL && opacity==1 )
                         {
-                            sandhash.insert ( val );
+                            sandTable[val & 0xff] = 1;
                         }
 
                         if ( mat->Attribute ( "nonsupport",&opacity ) !=NULL && opacity==1 )
                         {
-                            supporthash.insert ( val );
+                            nonSupportTable[val & 0xff] = 1;
                         }
                     }
                     mat=mat->NextSiblingElement();
@@ -579,6 +1163,164 @@ void loadObject (DFHack::color_ostream & c, TiXmlElement *elm, std::map<std::str
 
 }
 
+void replacespaces ( char* str )
+{
+    while ( *str!='\0' )
+    {
+        if ( *str==' ' || ( !isalnum ( *str ) && *str!='_' && *str!='.' && *str!='-' ) )
+            *str='_';
+        *str = tolower ( *str );
+        str++;
+    }
+}
+
+// Ramps, walls and buildings are named with numbers to indicate which sides have walls (or the buildings they face)
+// assuming the object is at position 5 (which will never be shown) the neighbours are numbered like this:
+// 1 2 3
+// 4 5 6
+// 7 8 9
+//
+// numbers are listed in number order, a wall to the south, southwest and west is 478 not 874 or other possibilities
+// if an object using all the numbers isn't defined, only directly north, south, east and west (2,4,6,8) are used
+// so if 478 is not found, 48 is checked and if that doesn't exist either no numbers are used
+//
+// the neighbours are kept as a bit mask, bit 0 is square 1 ... bit 3 is square 4, bit 4 is square 6 ... bit 7 is square 9
+// and the names for all 256 masks are worked out once when the objects are loaded
+#define DIR_CARDINALS 0x5A
+
+struct myDirTable
+{
+    char dir[256][9];   //numbers to add to the class name for each neighbour mask
+};
+
+struct myBuildingDirs
+{
+    int face[256];      //direction for each mask of neighbouring buildings to face, 0 if none defined
+    int wall[256];      //direction (to be negated) for each mask of neighbouring walls
+};
+
+#define NUM_TILE_CLASSES ( sizeof ( TileClassNames ) /sizeof ( TileClassNames[0] ) )
+myDirTable terrainDirs[NUM_TILE_CLASSES];
+int rampClass = -1;     //TileClassNames index of the ramp names
+std::map<std::string,myBuildingDirs> buildingDirs;
+
+void maskToDir ( int mask, char *dir )
+{
+    for ( int j=0;j<8;j++ )
+    {
+        if ( mask & ( 1<<j ) )
+        {
+            *dir = '1' + j + ( j<4 ? 0 : 1 );
+            dir++;
+        }
+    }
+    *dir='\0';
+}
+
+void buildTerrainDirs ( myDirTable &table, const char *classname )
+{
+    char full[16];
+    char cardinal[16];
+    char test[128];
+    for ( int m=0;m<256;m++ )
+    {
+        maskToDir ( m,full );
+        maskToDir ( m & DIR_CARDINALS,cardinal );
+        table.dir[m][0]='\0';
+
+        snprintf ( test,127,"%s%s",classname,full );
+        test[127]='\0';
+        replacespaces ( test );
+        if ( terrain.find ( test ) !=terrain.end() )
+        {
+            strcpy ( table.dir[m],full );
+            continue;
+        }
+        snprintf ( test,127,"%s%s",classname,cardinal );
+        test[127]='\0';
+        replacespaces ( test );
+        if ( terrain.find ( test ) !=terrain.end() )
+        {
+            strcpy ( table.dir[m],cardinal );
+        }
+    }
+}
+
+void buildBuildingDirs ( myBuildingDirs &table, const std::set<int> &dirs )
+{
+    char full[16];
+    char cardinal[16];
+    for ( int m=0;m<256;m++ )
+    {
+        maskToDir ( m,full );
+        maskToDir ( m & DIR_CARDINALS,cardinal );
+        int idir = atoi ( full );
+        int icard = atoi ( cardinal );
+
+        //facing other buildings - needs at least one neighbour
+        table.face[m]=0;
+        if ( idir!=0 && dirs.count ( idir ) )
+            table.face[m]=idir;
+        else if ( icard!=0 && dirs.count ( icard ) )
+            table.face[m]=icard;
+
+        //walls are stored as negative directions
+        table.wall[m]=0;
+        if ( dirs.count ( -idir ) )
+            table.wall[m]=idir;
+        else if ( dirs.count ( -icard ) )
+            table.wall[m]=icard;
+    }
+}
+
+void buildDirTables()
+{
+    //terrain that can have directions
+    for ( size_t i=0;i<NUM_TILE_CLASSES;i++ )
+    {
+        buildTerrainDirs ( terrainDirs[i],TileClassNames[i] );
+        if ( strcmp ( TileClassNames[i],"ramp" ) ==0 )
+            rampClass = ( int ) i;
+    }
+
+    //buildings are named 'name.direction' - collect the directions defined for each name
+    std::map<std::string,std::set<int> > dirs;
+    char test[32];
+    for ( std::map<std::string,uint8_t*>::iterator it = buildings.begin(); it!=buildings.end(); it++ )
+    {
+        size_t dot = it->first.rfind ( '.' );
+        if ( dot==std::string::npos )
+            continue;
+        int d = atoi ( it->first.c_str() +dot+1 );
+        snprintf ( test,31,"%d",d );
+        if ( it->first.compare ( dot+1,std::string::npos,test ) !=0 )
+            continue;   //not a direction
+        dirs[it->first.substr ( 0,dot )].insert ( d );
+    }
+
+    //'name.type.direction' falls back to 'name.direction'
+    buildingDirs.clear();
+    for ( std::map<std::string,std::set<int> >::iterator it = dirs.begin(); it!=dirs.end(); it++ )
+    {
+        std::set<int> all = it->second;
+        size_t dot = it->first.find ( '.' );
+        if ( dot!=std::string::npos )
+        {
+            std::map<std::string,std::set<int> >::iterator base = dirs.find ( it->first.substr ( 0,dot ) );
+            if ( base!=dirs.end() )
+                all.insert ( base->second.begin(),base->second.end() );
+        }
+        buildBuildingDirs ( buildingDirs[it->first],all );
+    }
+}
+
+const char* getObjDir ( int tileclass, uint8_t mask )
+{
+    if ( tileclass<0 || tileclass>= ( int ) NUM_TILE_CLASSES )
+        return "";
+    return terrainDirs[tileclass].dir[mask];
+}
+
 void loadDFObjects(DFHack::color_ostream & c)
 {
 
@@ -604,89 +1346,1079 @@ void loadDFObjects(DFHack::color_ostream & c)
     loadObject ( c, elm,buildings, true );
     c.print ( "loaded %d building types\n\n",buildings.size() );
 
+    buildDirTables();
+
 }
 
-int compressFile (DFHack::color_ostream & console, char* src, char* dest )
+//wall clock time in milliseconds, for timing the export phases
+int64_t getMillis()
 {
-    //compress file gzip
-    int ret, flush;
-    unsigned have;
-    z_stream strm;
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
+#ifdef LINUX_BUILD
+    struct timeval tv;
+    gettimeofday ( &tv, NULL );
+    return ( int64_t ) tv.tv_sec*1000 + tv.tv_usec/1000;
+#else
+    return ( int64_t ) clock() *1000 / CLOCKS_PER_SEC;//clock() is wall time with the MS runtime
+#endif
+}
 
-    FILE *s = fopen ( "out.mcraw","rb" );
-    if ( s==NULL )
-    {
-        console.printerr ( "Could not open file for reading, exiting." );
-        return -50;
-    }
+//finer wall clock for the phase timings, in microseconds
+int64_t getMicros()
+{
+#ifdef LINUX_BUILD
+    struct timeval tv;
+    gettimeofday ( &tv, NULL );
+    return ( int64_t ) tv.tv_sec*1000000 + tv.tv_usec;
+#else
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency ( &freq );
+    QueryPerformanceCounter ( &now );
+    return ( int64_t ) ( now.QuadPart / freq.QuadPart ) *1000000 + ( now.QuadPart % freq.QuadPart ) *1000000 / freq.QuadPart;
+#endif
+}
 
-    FILE *f = fopen ( dest,"wb" );
-    if ( f==NULL )
-    {
-        console.printerr ( "Could not open file for writing, exiting." );
-        return -51;
+//CPU time used by the calling thread so far, in microseconds
+int64_t getThreadCpuMicros()
+{
+#ifdef LINUX_BUILD
+    struct timespec ts;
+    clock_gettime ( CLOCK_THREAD_CPUTIME_ID, &ts );
+    return ( int64_t ) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#else
+    FILETIME created, exited, kernel, user;
+    GetThreadTimes ( GetCurrentThread(), &created, &exited, &kernel, &user );
+    uint64_t k = ( ( uint64_t ) kernel.dwHighDateTime<<32 ) | kernel.dwLowDateTime;
+    uint64_t u = ( ( uint64_t ) user.dwHighDateTime<<32 ) | user.dwLowDateTime;
+    return ( int64_t ) ( ( k+u ) /10 );//100ns units
+#endif
+}
+
+//times a phase on the calling thread, the CPU time includes any parallelFor workers started meanwhile
+//unless helpers is false, which the chunk workers use as helperCpu is only kept up by the export thread
+struct myPhaseTimer
+{
+    myPhaseTime &phase;
+    bool helpers;
+    int64_t wall;
+    int64_t cpu;
+
+    myPhaseTimer ( myPhaseTime &p, bool h = true ) : phase ( p ), helpers ( h )
+    {
+        wall = getMicros();
+        cpu = getThreadCpuMicros() + ( helpers ? exportStats.helperCpu : 0 );
+    }
+    void stop ( int64_t count = 0 )
+    {
+        phase.wall += getMicros()-wall;
+        phase.cpu += getThreadCpuMicros() + ( helpers ? exportStats.helperCpu : 0 ) - cpu;
+        phase.count += count;
+    }
+};
+
+//work stealing thread pool - each worker starts at the front of its own share of the items
+//and when that is empty takes items from the back of the other workers' shares
+struct myWorkQueue
+{
+    tthread::fast_mutex lock;
+    int next;   //next item to take from the front
+    int end;    //one past the last item, stolen from the back
+};
+
+struct myParallelFor
+{
+    void ( *func ) ( void *arg, int item, int worker );
+    void *arg;
+    int workers;
+    myWorkQueue *queues;
+};
+
+struct myWorker
+{
+    myParallelFor *job;
+    int index;
+    int64_t cpu;    //CPU time the worker's thread spent on the job
+    bool failed;    //ran out of memory, the job was abandoned
+};
+
+bool takeWork ( myWorkQueue &q, bool steal, int &item )
+{
+    bool ok = false;
+    q.lock.lock();
+    if ( q.next < q.end )
+    {
+        item = steal ? --q.end : q.next++;
+        ok = true;
+    }
+    q.lock.unlock();
+    return ok;
+}
+
+//a bad_alloc can't be let out of a thread, it would terminate Dwarf Fortress, so the worker
+//empties every queue to stop the others and parallelFor throws it again once they have all finished
+void parallelWorker ( void *arg )
+{
+    myWorker *w = ( myWorker* ) arg;
+    myParallelFor *job = w->job;
+    int64_t cpu = getThreadCpuMicros();
+    int item;
+    try
+    {
+        while ( true )
+        {
+            if ( takeWork ( job->queues[w->index], false, item ) )
+            {
+                job->func ( job->arg, item, w->index );
+                continue;
+            }
+
+            bool stolen = false;
+            for ( int i=1;i<job->workers && !stolen;i++ )
+            {
+                if ( takeWork ( job->queues[ ( w->index+i ) %job->workers], true, item ) )
+                {
+                    stolen = true;
+                    job->func ( job->arg, item, w->index );
+                }
+            }
+            if ( !stolen )
+                break;
+        }
+    }
+    catch ( std::bad_alloc & )
+    {
+        w->failed = true;
+        for ( int i=0;i<job->workers;i++ )
+        {
+            job->queues[i].lock.lock();
+            job->queues[i].next = job->queues[i].end;
+            job->queues[i].lock.unlock();
+        }
+    }
+    w->cpu = getThreadCpuMicros()-cpu;
+}
+
+int getThreadCount()
+{
+    if ( numThreads>0 )
+        return numThreads;
+    int cores = tthread::thread::hardware_concurrency();
+    return cores>0 ? cores : 1;
+}
+
+void parallelFor ( int workers, int items, void ( *func ) ( void *arg, int item, int worker ), void *arg )
+{
+    //calls func for every item, on up to 'workers' threads (the calling thread is one of them)
+    if ( items<1 )
+        return;
+    workers = max ( 1,min ( workers,items ) );
+
+    myParallelFor job;
+    job.func = func;
+    job.arg = arg;
+    job.workers = workers;
+    job.queues = new myWorkQueue[workers];
+    myWorker *w = new myWorker[workers];
+    for ( int i=0;i<workers;i++ )
+    {
+        job.queues[i].next = ( int ) ( ( int64_t ) items*i/workers );
+        job.queues[i].end = ( int ) ( ( int64_t ) items* ( i+1 ) /workers );
+        w[i].job = &job;
+        w[i].index = i;
+        w[i].cpu = 0;
+        w[i].failed = false;
+    }
+
+    //threads that couldn't be started leave their share to be stolen by the others
+    std::vector<tthread::thread*> threads;
+    threads.reserve ( workers );
+    for ( int i=1;i<workers;i++ )
+    {
+        try
+        {
+            threads.push_back ( new tthread::thread ( parallelWorker, &w[i] ) );
+        }
+        catch ( std::bad_alloc & )
+        {
+            break;
+        }
+    }
+    parallelWorker ( &w[0] );
+    for ( size_t i=0;i<threads.size();i++ )
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+    //the calling thread's own time is already counted by whatever is timing it
+    bool failed = false;
+    for ( int i=0;i<workers;i++ )
+    {
+        if ( i>0 )
+            exportStats.helperCpu += w[i].cpu;
+        failed = failed || w[i].failed;
+    }
+
+    delete[] w;
+    delete[] job.queues;
+    if ( failed )
+        throw std::bad_alloc();
+}
+
+
+//the converted world, kept as 16x16x16 sections so each chunk column is a few small blocks of memory
+//a section is only allocated when something other than zero (air, no light) is first written to it
+#define SECTION_BLOCKS  4096
+#define SECTION_NIBBLES 2048
+
+//light only goes up to 15, so the light planes are kept two to a byte, the even block in the low nibble
+inline uint8_t getNibble ( const uint8_t *plane, int idx )
+{
+    return ( plane[idx>>1] >> ( ( idx&1 ) <<2 ) ) & 0x0f;
+}
+
+inline void setNibble ( uint8_t *plane, int idx, uint8_t v )
+{
+    int shift = ( idx&1 ) <<2;
+    plane[idx>>1] = ( plane[idx>>1] & ~ ( 0x0f<<shift ) ) | ( ( v&0x0f ) <<shift );
+}
+
+//position inside a section - x along the rows, then y, then z (up) - the same order as the Anvil format
+inline int sectionIndex ( int x, int y, int z )
+{
+    return ( ( z&15 ) <<8 ) | ( ( y&15 ) <<4 ) | ( x&15 );
+}
+
+//storage for the section index arrays and light planes, which all come in a few power of two sizes
+//normally this is the heap, with <swapfile val="1"> it is a temporary file mapped into memory a region at a time, so an
+//export bigger than memory is paged out to disk by the OS instead of failing; freed pages are handed back with madvise
+#define STORE_REGION    ( 16*1024*1024 )
+#define STORE_MIN       512
+#define STORE_CLASSES   5   //512 bytes to 8KB
+
+struct mySectionStore
+{
+    tthread::fast_mutex lock;
+    std::vector<uint8_t*> freeLists[STORE_CLASSES];
+    std::vector<uint8_t*> regions;
+    uint8_t *next, *end;    //unused space in the newest region
+    int64_t fileSize;
+    size_t inUse;
+#ifdef LINUX_BUILD
+    int fd;
+#else
+    HANDLE file;
+    std::vector<HANDLE> mappings;
+#endif
+
+    mySectionStore() : next ( NULL ), end ( NULL ), fileSize ( 0 ), inUse ( 0 )
+    {
+#ifdef LINUX_BUILD
+        fd = -1;
+#else
+        file = INVALID_HANDLE_VALUE;
+#endif
+    }
+    ~mySectionStore()
+    {
+        close();
+    }
+
+    bool open ( const char *path )
+    {
+#ifdef LINUX_BUILD
+        fd = ::open ( path, O_RDWR | O_CREAT | O_TRUNC, 0600 );
+        if ( fd<0 )
+            return false;
+        unlink ( path );//gone as soon as it is closed
+#else
+        file = CreateFileA ( path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL );
+        if ( file==INVALID_HANDLE_VALUE )
+            return false;
+#endif
+        return true;
+    }
+    void close()
+    {
+#ifdef LINUX_BUILD
+        for ( size_t i=0;i<regions.size();i++ )
+            munmap ( regions[i], STORE_REGION );
+        if ( fd>=0 )
+            ::close ( fd );
+        fd = -1;
+#else
+        for ( size_t i=0;i<regions.size();i++ )
+            UnmapViewOfFile ( regions[i] );
+        for ( size_t i=0;i<mappings.size();i++ )
+            CloseHandle ( mappings[i] );
+        mappings.clear();
+        if ( file!=INVALID_HANDLE_VALUE )
+            CloseHandle ( file );
+        file = INVALID_HANDLE_VALUE;
+#endif
+        regions.clear();
+        next = end = NULL;
+    }
+
+    uint8_t *newRegion()
+    {
+        //room for the new view is made first, so running out of memory can't leave it mapped and lost
+        regions.reserve ( regions.size() +1 );
+#ifndef LINUX_BUILD
+        mappings.reserve ( mappings.size() +1 );
+#endif
+        int64_t offset = fileSize;
+        fileSize += STORE_REGION;
+#ifdef LINUX_BUILD
+        if ( ftruncate ( fd, fileSize ) !=0 )//sparse, the disk is only used as pages are written
+            return NULL;
+        void *p = mmap ( NULL, STORE_REGION, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset );
+        if ( p==MAP_FAILED )
+            return NULL;
+#else
+        HANDLE m = CreateFileMappingA ( file, NULL, PAGE_READWRITE, ( DWORD ) ( fileSize>>32 ), ( DWORD ) fileSize, NULL );
+        if ( m==NULL )
+            return NULL;
+        void *p = MapViewOfFile ( m, FILE_MAP_ALL_ACCESS, ( DWORD ) ( offset>>32 ), ( DWORD ) offset, STORE_REGION );
+        if ( p==NULL )
+        {
+            CloseHandle ( m );
+            return NULL;
+        }
+        mappings.push_back ( m );
+#endif
+        regions.push_back ( ( uint8_t* ) p );
+        return ( uint8_t* ) p;
+    }
+
+    static int sizeClass ( size_t size )
+    {
+        int c = 0;
+        while ( ( ( size_t ) STORE_MIN<<c ) < size )
+            c++;
+        return c;
+    }
+
+    uint8_t *alloc ( size_t size )
+    {
+        int c = sizeClass ( size );
+        uint8_t *p = NULL;
+        {
+            tthread::lock_guard<tthread::fast_mutex> guard ( lock );
+            if ( !freeLists[c].empty() )
+            {
+                p = freeLists[c].back();
+                freeLists[c].pop_back();
+            }
+            else
+            {
+                //blocks are aligned to their size, so anything of a page or more covers whole pages
+                size_t align = ( size_t ) STORE_MIN<<c;
+                if ( next!=NULL )
+                    next = ( uint8_t* ) ( ( ( size_t ) next + align-1 ) & ~ ( align-1 ) );
+                if ( next==NULL || next+align>end )
+                {
+                    next = newRegion();
+                    end = next ? next+STORE_REGION : NULL;
+                }
+                if ( next!=NULL )
+                {
+                    p = next;
+                    next += align;
+                }
+            }
+            if ( p!=NULL )
+                inUse += ( size_t ) STORE_MIN<<c;
+        }
+        if ( p==NULL )
+            throw std::bad_alloc();
+        return p;
+    }
+    void release ( uint8_t *p, size_t size )
+    {
+        int c = sizeClass ( size );
+#ifdef LINUX_BUILD
+        if ( ( ( size_t ) STORE_MIN<<c ) >= 4096 )
+        {
+            //the contents are finished with, let the kernel drop the pages (and the disk space, where it can)
+#ifdef MADV_REMOVE
+            madvise ( p, ( size_t ) STORE_MIN<<c, MADV_REMOVE );
+#else
+            madvise ( p, ( size_t ) STORE_MIN<<c, MADV_DONTNEED );
+#endif
+        }
+#endif
+        tthread::lock_guard<tthread::fast_mutex> guard ( lock );
+        freeLists[c].push_back ( p );
+        inUse -= ( size_t ) STORE_MIN<<c;
+    }
+};
+
+mySectionStore *sectionStore = NULL;   //NULL uses the heap
+int swapFile = 0;
+
+inline uint8_t *storeAlloc ( size_t size )
+{
+    return sectionStore ? sectionStore->alloc ( size ) : new uint8_t[size];
+}
+
+inline void storeFree ( uint8_t *p, size_t size )
+{
+    if ( p==NULL )
+        return;
+    if ( sectionStore )
+        sectionStore->release ( p,size );
+    else
+        delete[] p;
+}
+
+//blocks are stored as indices into a palette of the (block id, data) pairs the section uses, with only as many bits
+//per index as the palette needs - a section of a single material is one palette entry and no index array at all
+//the light planes are likewise only allocated once they hold more than one value
+struct mySection
+{
+    std::vector<uint16_t> palette;  //block id << 4 | data
+    uint8_t *indices;               //SECTION_BLOCKS indices of 'bits' bits each, NULL while bits is 0
+    int bits;                       //0, 1, 2, 4, 8 or 16, so an index never spans two bytes
+    int last;                       //palette slot last written, objects are mostly runs of one material
+    uint8_t *skylight, *blocklight; //nibble planes, NULL when every block has the fill value
+    uint8_t skyfill, blockfill;
+
+    mySection() : indices ( NULL ), bits ( 0 ), last ( 0 ), skylight ( NULL ), blocklight ( NULL ), skyfill ( 0 ), blockfill ( 0 )
+    {
+        palette.push_back ( 0 );
+    }
+    ~mySection()
+    {
+        storeFree ( indices,SECTION_BLOCKS*bits/8 );
+        storeFree ( skylight,SECTION_NIBBLES );
+        storeFree ( blocklight,SECTION_NIBBLES );
+    }
+
+    int slot ( int idx ) const
+    {
+        switch ( bits )
+        {
+        case 0:
+            return 0;
+        case 8:
+            return indices[idx];
+        case 16:
+            return ( ( const uint16_t* ) indices ) [idx];
+        default:
+        {
+            int bit = idx*bits;
+            return ( indices[bit>>3] >> ( bit&7 ) ) & ( ( 1<<bits )-1 );
+        }
+        }
+    }
+    void setSlot ( int idx, int v )
+    {
+        switch ( bits )
+        {
+        case 8:
+            indices[idx] = ( uint8_t ) v;
+            break;
+        case 16:
+            ( ( uint16_t* ) indices ) [idx] = ( uint16_t ) v;
+            break;
+        default:
+        {
+            int bit = idx*bits;
+            int mask = ( ( 1<<bits )-1 ) << ( bit&7 );
+            indices[bit>>3] = ( uint8_t ) ( ( indices[bit>>3] & ~mask ) | ( v << ( bit&7 ) ) );
+        }
+        }
+    }
+    //re-encode the indices with a different number of bits
+    void resize ( int newbits )
+    {
+        uint8_t *old = indices;
+        int oldbits = bits;
+        uint8_t *n = newbits ? storeAlloc ( SECTION_BLOCKS*newbits/8 ) : NULL;
+        if ( n )
+            memset ( n,0,SECTION_BLOCKS*newbits/8 );
+        std::vector<uint16_t> slots;
+        if ( n )
+        {
+            slots.resize ( SECTION_BLOCKS );
+            for ( int i=0;i<SECTION_BLOCKS;i++ )
+                slots[i] = ( uint16_t ) slot ( i );
+        }
+        indices = n;
+        bits = newbits;
+        for ( int i=0;n && i<SECTION_BLOCKS;i++ )
+            setSlot ( i,slots[i] );
+        storeFree ( old,SECTION_BLOCKS*oldbits/8 );
+    }
+
+    uint16_t value ( int idx ) const
+    {
+        return palette[slot ( idx )];
+    }
+    uint8_t block ( int idx ) const
+    {
+        return ( uint8_t ) ( value ( idx ) >>4 );
+    }
+    uint8_t data ( int idx ) const
+    {
+        return ( uint8_t ) ( value ( idx ) & 0x0f );
+    }
+    void set ( int idx, uint8_t blocktype, uint8_t blockdata )
+    {
+        uint16_t v = ( uint16_t ) ( ( blocktype<<4 ) | ( blockdata&0x0f ) );
+        if ( palette[last]!=v )
+        {
+            int n = ( int ) palette.size();
+            int i = 0;
+            while ( i<n && palette[i]!=v )
+                i++;
+            if ( i==n )
+            {
+                palette.push_back ( v );
+                if ( n >= ( 1<<bits ) )
+                    resize ( bits ? bits*2 : 1 );
+            }
+            last = i;
+        }
+        if ( bits )
+            setSlot ( idx,last );
+    }
+
+    //drop palette entries that are no longer used, a section filled with one material goes back to no index array
+    void compact()
+    {
+        std::vector<int> remap ( palette.size(),-1 );
+        std::vector<uint16_t> used;
+        for ( int i=0;i<SECTION_BLOCKS;i++ )
+        {
+            int s = slot ( i );
+            if ( remap[s]<0 )
+            {
+                remap[s] = ( int ) used.size();
+                used.push_back ( palette[s] );
+            }
+        }
+        if ( used.size() ==palette.size() )
+            return;
+        int newbits = 0;
+        while ( ( 1<<newbits ) < ( int ) used.size() )
+            newbits = newbits ? newbits*2 : 1;
+        std::vector<uint16_t> slots ( SECTION_BLOCKS );
+        for ( int i=0;i<SECTION_BLOCKS;i++ )
+            slots[i] = ( uint16_t ) remap[slot ( i )];
+        storeFree ( indices,SECTION_BLOCKS*bits/8 );
+        indices = NULL;
+        bits = 0;
+        palette = used;
+        last = 0;
+        if ( newbits )
+        {
+            indices = storeAlloc ( SECTION_BLOCKS*newbits/8 );
+            bits = newbits;
+            for ( int i=0;i<SECTION_BLOCKS;i++ )
+                setSlot ( i,slots[i] );
+        }
+    }
+
+    uint8_t sky ( int idx ) const
+    {
+        return skylight ? getNibble ( skylight,idx ) : skyfill;
+    }
+    uint8_t blockLight ( int idx ) const
+    {
+        return blocklight ? getNibble ( blocklight,idx ) : blockfill;
+    }
+    static void setLight ( uint8_t *&plane, uint8_t fill, int idx, uint8_t v )
+    {
+        if ( plane==NULL )
+        {
+            if ( v==fill )
+                return;
+            plane = storeAlloc ( SECTION_NIBBLES );
+            memset ( plane,fill* 0x11,SECTION_NIBBLES );
+        }
+        setNibble ( plane,idx,v );
+    }
+    void setSky ( int idx, uint8_t v )
+    {
+        setLight ( skylight,skyfill,idx,v );
+    }
+    void setBlockLight ( int idx, uint8_t v )
+    {
+        setLight ( blocklight,blockfill,idx,v );
+    }
+    //a light plane that ended up all one value goes back to just the fill value
+    static void compactLight ( uint8_t *&plane, uint8_t &fill )
+    {
+        if ( plane==NULL )
+            return;
+        uint8_t b = plane[0];
+        if ( ( b>>4 ) != ( b&0x0f ) )
+            return;
+        for ( int i=1;i<SECTION_NIBBLES;i++ )
+            if ( plane[i]!=b )
+                return;
+        fill = b&0x0f;
+        storeFree ( plane,SECTION_NIBBLES );
+        plane = NULL;
+    }
+    void compactLight()
+    {
+        compactLight ( skylight,skyfill );
+        compactLight ( blocklight,blockfill );
+    }
+    //back to unlit, so the section can be lit again from scratch
+    void clearLight()
+    {
+        storeFree ( skylight,SECTION_NIBBLES );
+        storeFree ( blocklight,SECTION_NIBBLES );
+        skylight = NULL;
+        blocklight = NULL;
+        skyfill = 0;
+        blockfill = 0;
+    }
+
+    //expand to the flat Anvil arrays, a byte per block and nibbles for the rest
+    void unpack ( uint8_t *blocks, uint8_t *data, uint8_t *sky, uint8_t *light ) const
+    {
+        memset ( data,0,SECTION_NIBBLES );
+        for ( int i=0;i<SECTION_BLOCKS;i++ )
+        {
+            uint16_t v = value ( i );
+            blocks[i] = ( uint8_t ) ( v>>4 );
+            data[i>>1] |= ( v&0x0f ) << ( ( i&1 ) <<2 );
+        }
+        if ( skylight )
+            memcpy ( sky,skylight,SECTION_NIBBLES );
+        else
+            memset ( sky,skyfill*0x11,SECTION_NIBBLES );
+        if ( blocklight )
+            memcpy ( light,blocklight,SECTION_NIBBLES );
+        else
+            memset ( light,blockfill*0x11,SECTION_NIBBLES );
+    }
+
+    bool allAir() const
+    {
+        for ( size_t i=0;i<palette.size();i++ )
+            if ( ( palette[i]>>4 ) !=0 )
+                return false;
+        return true;
+    }
+
+    size_t bytes() const
+    {
+        return sizeof ( mySection ) + palette.capacity() *sizeof ( uint16_t ) + SECTION_BLOCKS*bits/8 +
+               ( skylight ? SECTION_NIBBLES : 0 ) + ( blocklight ? SECTION_NIBBLES : 0 );
+    }
+};
+
+typedef mySection * volatile mySectionPtr;
+
+struct myWorld
+{
+    int xsize, ysize, zsize;
+    int chunksx, chunksy, sectionsz;
+    mySectionPtr *sections;     //chunk by chunk (x then y), bottom section first in each
+    uint16_t **heights;         //per chunk, the height sky light comes straight down to in each column, once it is lit
+    std::vector<uint32_t> *lightBlocks; //per chunk, where light giving and partially lit blocks were put, as z<<8|y<<4|x
+    int allocated;
+    tthread::fast_mutex lock;
+
+    myWorld() : xsize ( 0 ), ysize ( 0 ), zsize ( 0 ), chunksx ( 0 ), chunksy ( 0 ), sectionsz ( 0 ), sections ( NULL ), heights ( NULL ), lightBlocks ( NULL ), allocated ( 0 ) {}
+    ~myWorld()
+    {
+        clear();
+    }
+
+    void init ( int x, int y, int z )
+    {
+        clear();
+        xsize = x;
+        ysize = y;
+        zsize = z;
+        chunksx = ( x+15 ) /16;
+        chunksy = ( y+15 ) /16;
+        sectionsz = ( z+15 ) /16;
+        int count = chunksx*chunksy*sectionsz;
+        sections = new mySectionPtr[count];
+        for ( int i=0;i<count;i++ )
+            sections[i] = NULL;
+        heights = new uint16_t*[chunksx*chunksy];
+        for ( int i=0;i<chunksx*chunksy;i++ )
+            heights[i] = NULL;
+        lightBlocks = new std::vector<uint32_t>[chunksx*chunksy];
+    }
+    void clear()
+    {
+        if ( sections==NULL )
+            return;
+        for ( int i=0;i<chunksx*chunksy*sectionsz;i++ )
+            delete sections[i];
+        delete[] sections;
+        sections = NULL;
+        for ( int i=0;i<chunksx*chunksy;i++ )
+            delete[] heights[i];
+        delete[] heights;
+        heights = NULL;
+        delete[] lightBlocks;
+        lightBlocks = NULL;
+        allocated = 0;
+    }
+    //free a chunk column once it has been saved
+    void releaseChunk ( int cx, int cy )
+    {
+        for ( int sz=0;sz<sectionsz;sz++ )
+        {
+            mySectionPtr &s = sections[ ( cx*chunksy + cy ) *sectionsz + sz];
+            if ( s!=NULL )
+            {
+                delete s;
+                s = NULL;
+                allocated--;
+            }
+        }
+        delete[] heights[cx*chunksy + cy];
+        heights[cx*chunksy + cy] = NULL;
+        std::vector<uint32_t>().swap ( lightBlocks[cx*chunksy + cy] );
+    }
+
+    //the chunk's height map, indexed y*16+x as Minecraft has it, allocated when first asked for
+    uint16_t *chunkHeights ( int cx, int cy )
+    {
+        uint16_t *&h = heights[cx*chunksy + cy];
+        if ( h==NULL )
+            h = new uint16_t[16*16];
+        return h;
+    }
+    //everything from here up is lit straight from the sky, the top of the world until the chunk has been lit
+    int height ( int x, int y ) const
+    {
+        const uint16_t *h = heights[ ( x>>4 ) *chunksy + ( y>>4 )];
+        return h ? h[ ( ( y&15 ) <<4 ) | ( x&15 )] : zsize;
+    }
+
+    bool inside ( int x, int y, int z ) const
+    {
+        return x>=0 && y>=0 && z>=0 && x<xsize && y<ysize && z<zsize;
+    }
+    //section for a chunk column, NULL if nothing has been written there
+    mySection *section ( int cx, int cy, int sz ) const
+    {
+        return sections[ ( cx*chunksy + cy ) *sectionsz + sz];
+    }
+    mySection *get ( int x, int y, int z ) const
+    {
+        if ( !inside ( x,y,z ) )
+            return NULL;
+        return section ( x>>4,y>>4,z>>4 );
+    }
+    mySection *getForWrite ( int x, int y, int z )
+    {
+        if ( !inside ( x,y,z ) )
+            return NULL;
+        mySectionPtr &s = sections[ ( ( x>>4 ) *chunksy + ( y>>4 ) ) *sectionsz + ( z>>4 )];
+        if ( s==NULL )
+        {
+            //conversion threads can meet in the same section
+            //the guard lets go of the lock if running out of memory throws
+            tthread::lock_guard<tthread::fast_mutex> guard ( lock );
+            if ( s==NULL )
+            {
+                mySection *n = new mySection;
+                //once lit, air in full sky is only implied by the height map, it has to be filled in when
+                //light spreading through the air brings the section into being
+                const uint16_t *h = heights[ ( x>>4 ) *chunksy + ( y>>4 )];
+                if ( h )
+                {
+                    try
+                    {
+                        int base = z&~15;
+                        for ( int i=0;i<16*16;i++ )
+                            for ( int zz=max ( h[i]-base,0 );zz<16;zz++ )
+                                n->setSky ( ( zz<<8 ) | i,15 );
+                        n->compactLight();
+                    }
+                    catch ( std::bad_alloc & )
+                    {
+                        delete n;
+                        throw;
+                    }
+                }
+                s = n;
+                allocated++;
+            }
+        }
+        return s;
+    }
+
+    uint8_t getBlock ( int x, int y, int z ) const
+    {
+        mySection *s = get ( x,y,z );
+        return s ? s->block ( sectionIndex ( x,y,z ) ) : 0;
+    }
+    uint8_t getData ( int x, int y, int z ) const
+    {
+        mySection *s = get ( x,y,z );
+        return s ? s->data ( sectionIndex ( x,y,z ) ) : 0;
+    }
+    //sections that were never written to are air, so they are in full sky above the height map and dark below
+    uint8_t getSkyLight ( int x, int y, int z ) const
+    {
+        mySection *s = get ( x,y,z );
+        if ( s )
+            return s->sky ( sectionIndex ( x,y,z ) );
+        return inside ( x,y,z ) && z>=height ( x,y ) ? 15 : 0;
+    }
+    uint8_t getBlockLight ( int x, int y, int z ) const
+    {
+        mySection *s = get ( x,y,z );
+        return s ? s->blockLight ( sectionIndex ( x,y,z ) ) : 0;
+    }
+
+    //writing zero into a section that isn't there yet changes nothing, so it isn't created for it
+    //a DF block always covers whole sections (16*squaresize MC blocks) so conversion threads never share one
+    void setBlock ( int x, int y, int z, uint8_t blocktype, uint8_t blockdata )
+    {
+        blockdata &= 0x0f;
+        mySection *s = ( blocktype || blockdata ) ? getForWrite ( x,y,z ) : get ( x,y,z );
+        if ( s ) s->set ( sectionIndex ( x,y,z ),blocktype,blockdata );
+    }
+    void setSkyLight ( int x, int y, int z, uint8_t v )
+    {
+        v &= 0x0f;
+        mySection *s = v ? getForWrite ( x,y,z ) : get ( x,y,z );
+        if ( s ) s->setSky ( sectionIndex ( x,y,z ),v );
+    }
+    void setBlockLight ( int x, int y, int z, uint8_t v )
+    {
+        v &= 0x0f;
+        mySection *s = v ? getForWrite ( x,y,z ) : get ( x,y,z );
+        if ( s ) s->setBlockLight ( sectionIndex ( x,y,z ),v );
+    }
+
+    size_t bytes() const
+    {
+        size_t total = ( size_t ) chunksx*chunksy* ( sectionsz*sizeof ( mySectionPtr ) + sizeof ( uint16_t* ) );
+        for ( int i=0;i<chunksx*chunksy*sectionsz;i++ )
+            if ( sections[i] )
+                total += sections[i]->bytes();
+        for ( int i=0;i<chunksx*chunksy;i++ )
+        {
+            if ( heights[i] )
+                total += 16*16*sizeof ( uint16_t );
+            total += lightBlocks[i].capacity() *sizeof ( uint32_t );
+        }
+        return total;
+    }
+};
+
+struct myCompactJob
+{
+    myWorld *world;
+    int first;  //first section of the chunk columns being compacted
+};
+
+void compactSection ( void *arg, int item, int /*worker*/ )
+{
+    myCompactJob *job = ( myCompactJob* ) arg;
+    mySection *s = job->world->sections[job->first + item];
+    if ( s )
+    {
+        s->compact();
+        s->compactLight();
     }
+}
 
-    //most of the rest of this is from a zlib example
+//shrink the sections of chunk columns cx0 up to cx1 down to what they actually hold, between the conversion stages
+void compactWorld ( myWorld &world, int cx0, int cx1 )
+{
+    myCompactJob job;
+    job.world = &world;
+    job.first = cx0*world.chunksy*world.sectionsz;
+    parallelFor ( getThreadCount(), ( cx1-cx0 ) *world.chunksy*world.sectionsz, compactSection, &job );
+}
 
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit2 ( &strm, Z_BEST_COMPRESSION,Z_DEFLATED,31,9,Z_DEFAULT_STRATEGY );//the 31 indicates gzip, set to 15 for normal zlib file header
-    if ( ret != Z_OK )
+
+//NBT (Minecraft's named binary tag format) built up in memory, all numbers are big endian
+#define TAG_END         0
+#define TAG_BYTE        1
+#define TAG_SHORT       2
+#define TAG_INT         3
+#define TAG_LONG        4
+#define TAG_FLOAT       5
+#define TAG_DOUBLE      6
+#define TAG_BYTE_ARRAY  7
+#define TAG_STRING      8
+#define TAG_LIST        9
+#define TAG_COMPOUND    10
+#define TAG_INT_ARRAY   11
+
+struct myNBT
+{
+    std::vector<uint8_t> buf;
+
+    void raw ( const void *data, size_t len )
     {
-        console.printerr ( "Unable to initalize compression routine, exiting." );
-        return ret;
+        const uint8_t *p = ( const uint8_t* ) data;
+        buf.insert ( buf.end(),p,p+len );
     }
-
-    /* compress until end of file */
-    do
+    void u8 ( uint8_t v )
     {
-        strm.avail_in = fread ( in, 1, CHUNK, s );
-        if ( ferror ( s ) )
-        {
-            ( void ) deflateEnd ( &strm );
-            return Z_ERRNO;
-        }
-        flush = feof ( s ) ? Z_FINISH : Z_NO_FLUSH;
-        strm.next_in = in;
-
-        /* run deflate() on input until output buffer not full, finish
-        compression if all of source has been read in */
-        do
-        {
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-            ret = deflate ( &strm, flush ); /* no bad return value */
-            assert ( ret != Z_STREAM_ERROR );  /* state not clobbered */
-            have = CHUNK - strm.avail_out;
-            if ( fwrite ( out, 1, have, f ) != have || ferror ( f ) )
-            {
-                ( void ) deflateEnd ( &strm );
-                return Z_ERRNO;
-            }
-        }
-        while ( strm.avail_out == 0 );
-        assert ( strm.avail_in == 0 );  /* all input will be used */
+        buf.push_back ( v );
+    }
+    void be16 ( int16_t v )
+    {
+        u8 ( ( uint8_t ) ( v>>8 ) );
+        u8 ( ( uint8_t ) v );
+    }
+    void be32 ( int32_t v )
+    {
+        be16 ( ( int16_t ) ( v>>16 ) );
+        be16 ( ( int16_t ) v );
+    }
+    void be64 ( int64_t v )
+    {
+        be32 ( ( int32_t ) ( v>>32 ) );
+        be32 ( ( int32_t ) v );
+    }
+    void beDouble ( double v )
+    {
+        int64_t i;
+        memcpy ( &i,&v,8 );
+        be64 ( i );
+    }
+    void name ( uint8_t type, const char *tagname )
+    {
+        u8 ( type );
+        int16_t len = ( int16_t ) strlen ( tagname );
+        be16 ( len );
+        raw ( tagname,len );
+    }
 
-        /* done when last data in file processed */
+    void compound ( const char *tagname )
+    {
+        name ( TAG_COMPOUND,tagname );
+    }
+    void end()
+    {
+        u8 ( TAG_END );
+    }
+    void list ( const char *tagname, uint8_t type, int32_t count )
+    {
+        name ( TAG_LIST,tagname );
+        u8 ( type );
+        be32 ( count );
+    }
+    void tagByte ( const char *tagname, uint8_t v )
+    {
+        name ( TAG_BYTE,tagname );
+        u8 ( v );
+    }
+    void tagShort ( const char *tagname, int16_t v )
+    {
+        name ( TAG_SHORT,tagname );
+        be16 ( v );
+    }
+    void tagInt ( const char *tagname, int32_t v )
+    {
+        name ( TAG_INT,tagname );
+        be32 ( v );
+    }
+    void tagLong ( const char *tagname, int64_t v )
+    {
+        name ( TAG_LONG,tagname );
+        be64 ( v );
     }
-    while ( flush != Z_FINISH );
-    assert ( ret == Z_STREAM_END );     /* stream will be complete */
+    void tagFloat ( const char *tagname, float v )
+    {
+        int32_t i;
+        memcpy ( &i,&v,4 );
+        name ( TAG_FLOAT,tagname );
+        be32 ( i );
+    }
+    void tagString ( const char *tagname, const char *str )
+    {
+        name ( TAG_STRING,tagname );
+        int16_t len = ( int16_t ) strlen ( str );
+        be16 ( len );
+        raw ( str,len );
+    }
+    void tagByteArray ( const char *tagname, const void *data, int32_t len )
+    {
+        name ( TAG_BYTE_ARRAY,tagname );
+        be32 ( len );
+        raw ( data,len );
+    }
+    void tagIntArray ( const char *tagname, const int32_t *data, int32_t len )
+    {
+        name ( TAG_INT_ARRAY,tagname );
+        be32 ( len );
+        for ( int i=0;i<len;i++ )
+            be32 ( data[i] );
+    }
+};
+
+#define GZIP_WINDOW 31  //gzip header, for the Alpha chunks and level.dat
+#define ZLIB_WINDOW 15  //zlib header, for chunks in region files
 
+int deflateBuffer ( const std::vector<uint8_t> &in, std::vector<uint8_t> &out, int level, int strategy, int windowBits )
+{
+    //compress straight from memory to memory
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    int ret = deflateInit2 ( &strm, level,Z_DEFLATED,windowBits,9,strategy );
+    if ( ret != Z_OK )
+        return ret;
 
-    /* clean up and return */
+    out.resize ( deflateBound ( &strm, ( uLong ) in.size() ) + 32 );//deflateBound doesn't count the gzip header in older zlib versions
+    strm.next_in = ( Bytef* ) ( in.empty() ? NULL : &in[0] );
+    strm.avail_in = ( uInt ) in.size();
+    strm.next_out = &out[0];
+    strm.avail_out = ( uInt ) out.size();
+    ret = deflate ( &strm, Z_FINISH );
+    out.resize ( out.size() - strm.avail_out );
     ( void ) deflateEnd ( &strm );
 
-    fclose ( f );
-    fclose ( s );
+    return ret == Z_STREAM_END ? Z_OK : Z_BUF_ERROR;
+}
 
+//only called from the export thread, which is what the file I/O timing expects
+int writeFile ( DFHack::color_ostream & console, const char* dest, const std::vector<uint8_t> &data )
+{
+    myPhaseTimer timer ( exportStats.phases[PHASE_WRITE] );
+    FILE *f = fopen ( dest,"wb" );
+    if ( f==NULL )
+    {
+        console.printerr ( "Could not open file for writing, exiting." );
+        timer.stop();
+        return -51;
+    }
+    if ( !data.empty() && fwrite ( &data[0],1,data.size(),f ) != data.size() )
+    {
+        fclose ( f );
+        timer.stop();
+        return Z_ERRNO;
+    }
+    fclose ( f );
+    exportStats.bytes += data.size();
+    timer.stop ( 1 );
     return Z_OK;
 }
 
+int saveCompressed ( DFHack::color_ostream & console, const char* dest, const myNBT &nbt )
+{
+    std::vector<uint8_t> gz;
+    myPhaseTimer timer ( exportStats.phases[PHASE_COMPRESS] );
+    int res = deflateBuffer ( nbt.buf, gz, compression->level, compression->strategy, GZIP_WINDOW );
+    timer.stop ( 1 );
+    if ( res != Z_OK )
+        return res;
+    return writeFile ( console, dest, gz );
+}
+
 void base36 ( int val, char* str )
 {
     char *alpha = "0123456789abcdefghijklmnopqrstuvwxyz";
@@ -717,11 +2449,9 @@ void base36 ( int val, char* str )
     strrev ( str );
 }
 
-int saveChunk ( DFHack::color_ostream & out, char* dirname,uint8_t* mclayers,uint8_t* mcdata,uint8_t* mcskylight,uint8_t* mcblocklight,int mcxsquares,int mcysquares,int mczsquares,int x, int y, int64_t &size )
+int chunkPath ( char* dirname, int x, int y, char *path )
 {
-
     //make sure path for chunk exists - this should be x then y but south is +x and east is -y
-    char path[1024];
     char part[16];
     //int xpos = y/16;
     //int ypos = -x/16;
@@ -757,178 +2487,663 @@ int saveChunk ( DFHack::color_ostream & out, char* dirname,uint8_t* mclayers,uin
     strncat ( path,".dat",1023 );
     path[1023]='\0';
 
+    return 0;
+}
 
-    int of = open ( "out.mcraw", O_BINARY | _O_CREAT | _O_TRUNC | _O_WRONLY,_S_IREAD | _S_IWRITE );
-
-    //first write the raw file to disk
-    write ( of,"\012\000\000\012\000\005Level\011\000\010Entities\012\000\000\000\000\011\000\014TileEntities\012\000\000\000\000\001\000\020TerrainPopulated\001\004\000\012LastUpdate",80 );
-    int64_t timer = 0;//apparently game time, not unix time
-    //_time64(&timer);
-    write ( of, ( ( char* ) ( &timer ) ) +7,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +6,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +5,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +4,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +3,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +2,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +1,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +0,1 );
-
-    write ( of,"\003\000\004xPos",7 );
-    char val[9];
-    val[0] = * ( ( ( char* ) ( &xpos ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &xpos ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &xpos ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &xpos ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
-    write ( of,"\003\000\004zPos",7 );
-    val[0] = * ( ( ( char* ) ( &ypos ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &ypos ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &ypos ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &ypos ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
-
+//Alpha and McRegion chunks keep each column of blocks together, index z + y*128 + x*128*16, with the nibble arrays
+//paired along z, so every section has to be turned on its side on the way out - a 16x16 byte transpose for each y
+typedef void ( *myPackSectionFunc ) ( const uint8_t *blocks, const uint8_t *data, const uint8_t *sky, const uint8_t *light, int sz,
+                                      uint8_t *outblocks, uint8_t *outdata, uint8_t *outsky, uint8_t *outlight );
+myPackSectionFunc packSectionFunc = NULL;
 
-    //prepair data
-    char blocks[16*16*CHUNK_HEIGHT];
-    char data[16*16*CHUNK_HEIGHT/2];
-    char skylight[16*16*CHUNK_HEIGHT/2];
-    char blocklight[16*16*CHUNK_HEIGHT/2];
-    char heightmap[16*16];
-    memset ( blocks,0,16*16*CHUNK_HEIGHT );
-    memset ( data,0,16*16*CHUNK_HEIGHT/2 );
-    memset ( skylight,0,16*16*CHUNK_HEIGHT/2 );
-    memset ( blocklight,0,16*16*CHUNK_HEIGHT/2 );
-    memset ( heightmap,0,16*16 );
+inline int alphaIndex ( int x, int y, int z )
+{
+    return z + y*CHUNK_HEIGHT + x*CHUNK_HEIGHT*16;
+}
 
-    for ( int zz=0;zz<mczsquares;zz++ )
+void packSection ( const uint8_t *blocks, const uint8_t *data, const uint8_t *sky, const uint8_t *light, int sz,
+                   uint8_t *outblocks, uint8_t *outdata, uint8_t *outsky, uint8_t *outlight )
+{
+    for ( int x=0;x<16;x++ )
     {
-        for ( int yy=0;yy<16;yy++ )
+        for ( int y=0;y<16;y++ )
         {
-            for ( int xx=0;xx<16;xx++ )
+            int out = alphaIndex ( x,y,sz*16 );
+            for ( int z=0;z<16;z++ )
+                outblocks[out+z] = blocks[sectionIndex ( x,y,z )];
+            for ( int z=0;z<16;z+=2 )
             {
+                int lo = sectionIndex ( x,y,z );
+                int hi = sectionIndex ( x,y,z+1 );
+                outdata[ ( out+z ) /2] = getNibble ( data,lo ) | ( getNibble ( data,hi ) <<4 );
+                outsky[ ( out+z ) /2] = getNibble ( sky,lo ) | ( getNibble ( sky,hi ) <<4 );
+                outlight[ ( out+z ) /2] = getNibble ( light,lo ) | ( getNibble ( light,hi ) <<4 );
+            }
+        }
+    }
+}
 
-                //get info for current position
-                int idx = x+xx + ( zz * mcysquares +y+yy ) * mcxsquares;
-                assert ( idx< ( mcxsquares*mcysquares*mczsquares ) );
+//unpack lo/hi by 8, 16, 32 and 64 bits transposes a 16x16 block of bytes, but leaves the columns in bit reversed order
+static const int transposeRow[16] = { 0,8,4,12,2,10,6,14,1,9,5,13,3,11,7,15 };
 
-                int blocktype = mclayers[idx];
-                int blockdata = mcdata[idx]; //upper nibble is the data because of mclevel format
-                int skyl = mcskylight[idx];
-                int blockl = mcblocklight[idx];
+#ifdef USE_SSE2
+TARGET_SSE2 inline void transpose16SSE2 ( __m128i *r )
+{
+    __m128i t[16];
+    for ( int i=0;i<8;i++ )
+    {
+        t[i] = _mm_unpacklo_epi8 ( r[2*i],r[2*i+1] );
+        t[i+8] = _mm_unpackhi_epi8 ( r[2*i],r[2*i+1] );
+    }
+    for ( int i=0;i<8;i++ )
+    {
+        r[i] = _mm_unpacklo_epi16 ( t[2*i],t[2*i+1] );
+        r[i+8] = _mm_unpackhi_epi16 ( t[2*i],t[2*i+1] );
+    }
+    for ( int i=0;i<8;i++ )
+    {
+        t[i] = _mm_unpacklo_epi32 ( r[2*i],r[2*i+1] );
+        t[i+8] = _mm_unpackhi_epi32 ( r[2*i],r[2*i+1] );
+    }
+    for ( int i=0;i<8;i++ )
+    {
+        r[i] = _mm_unpacklo_epi64 ( t[2*i],t[2*i+1] );
+        r[i+8] = _mm_unpackhi_epi64 ( t[2*i],t[2*i+1] );
+    }
+}
 
-                int index = zz + ( yy * CHUNK_HEIGHT + ( xx * CHUNK_HEIGHT * 16 ) ) ;
-                assert ( index< ( 16 * 16 * CHUNK_HEIGHT ) );
+//a nibble plane is spread out to one byte a block, transposed, then each pair along z is packed back into one byte
+TARGET_SSE2 void packNibblesSSE2 ( const uint8_t *plane, int sz, uint8_t *out )
+{
+    const __m128i low = _mm_set1_epi8 ( 0x0f );
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i even = _mm_set1_epi16 ( 0x00ff );
+    __m128i r[16];
+    for ( int y=0;y<16;y++ )
+    {
+        for ( int z=0;z<16;z++ )
+        {
+            __m128i row = _mm_loadl_epi64 ( ( const __m128i* ) ( plane + sectionIndex ( 0,y,z ) /2 ) );
+            r[z] = _mm_unpacklo_epi8 ( _mm_and_si128 ( row,low ),_mm_and_si128 ( _mm_srli_epi16 ( row,4 ),low ) );
+        }
+        transpose16SSE2 ( r );
+        for ( int x=0;x<16;x++ )
+        {
+            __m128i col = r[transposeRow[x]];
+            col = _mm_or_si128 ( _mm_and_si128 ( col,even ),_mm_srli_epi16 ( col,4 ) );
+            _mm_storel_epi64 ( ( __m128i* ) ( out + alphaIndex ( x,y,sz*16 ) /2 ),_mm_packus_epi16 ( col,zero ) );
+        }
+    }
+}
 
-                blocks[index] = blocktype;
+TARGET_SSE2 void packSectionSSE2 ( const uint8_t *blocks, const uint8_t *data, const uint8_t *sky, const uint8_t *light, int sz,
+                                   uint8_t *outblocks, uint8_t *outdata, uint8_t *outsky, uint8_t *outlight )
+{
+    __m128i r[16];
+    for ( int y=0;y<16;y++ )
+    {
+        for ( int z=0;z<16;z++ )
+            r[z] = _mm_loadu_si128 ( ( const __m128i* ) ( blocks + sectionIndex ( 0,y,z ) ) );
+        transpose16SSE2 ( r );
+        for ( int x=0;x<16;x++ )
+            _mm_storeu_si128 ( ( __m128i* ) ( outblocks + alphaIndex ( x,y,sz*16 ) ),r[transposeRow[x]] );
+    }
+    packNibblesSSE2 ( data,sz,outdata );
+    packNibblesSSE2 ( sky,sz,outsky );
+    packNibblesSSE2 ( light,sz,outlight );
+}
+#endif
 
-                if ( blocktype!=0 )
-                    heightmap[yy*16 + xx] = min ( zz+1,CHUNK_HEIGHT-1 );
+#ifdef USE_AVX2
+//the unpacks stay inside each 128 bit lane, so one pass transposes two rows of y at once, y in the low lane and y+1 in the high
+TARGET_AVX2 inline void transpose16AVX2 ( __m256i *r )
+{
+    __m256i t[16];
+    for ( int i=0;i<8;i++ )
+    {
+        t[i] = _mm256_unpacklo_epi8 ( r[2*i],r[2*i+1] );
+        t[i+8] = _mm256_unpackhi_epi8 ( r[2*i],r[2*i+1] );
+    }
+    for ( int i=0;i<8;i++ )
+    {
+        r[i] = _mm256_unpacklo_epi16 ( t[2*i],t[2*i+1] );
+        r[i+8] = _mm256_unpackhi_epi16 ( t[2*i],t[2*i+1] );
+    }
+    for ( int i=0;i<8;i++ )
+    {
+        t[i] = _mm256_unpacklo_epi32 ( r[2*i],r[2*i+1] );
+        t[i+8] = _mm256_unpackhi_epi32 ( r[2*i],r[2*i+1] );
+    }
+    for ( int i=0;i<8;i++ )
+    {
+        r[i] = _mm256_unpacklo_epi64 ( t[2*i],t[2*i+1] );
+        r[i+8] = _mm256_unpackhi_epi64 ( t[2*i],t[2*i+1] );
+    }
+}
 
-                if ( zz%2==0 )
-                {
-                    data[index/2] |= ( blockdata >> 4 );
-                    skylight[index/2] |= ( skyl & 0x0f );
-                    blocklight[index/2] |= ( blockl &0x0f );
-                }
-                else
+TARGET_AVX2 void packNibblesAVX2 ( const uint8_t *plane, int sz, uint8_t *out )
+{
+    const __m128i low = _mm_set1_epi8 ( 0x0f );
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i even = _mm256_set1_epi16 ( 0x00ff );
+    __m256i r[16];
+    for ( int y=0;y<16;y+=2 )
+    {
+        for ( int z=0;z<16;z++ )
+        {
+            __m128i rows = _mm_loadu_si128 ( ( const __m128i* ) ( plane + sectionIndex ( 0,y,z ) /2 ) );
+            __m128i lo = _mm_and_si128 ( rows,low );
+            __m128i hi = _mm_and_si128 ( _mm_srli_epi16 ( rows,4 ),low );
+            r[z] = _mm256_inserti128_si256 ( _mm256_castsi128_si256 ( _mm_unpacklo_epi8 ( lo,hi ) ),_mm_unpackhi_epi8 ( lo,hi ),1 );
+        }
+        transpose16AVX2 ( r );
+        for ( int x=0;x<16;x++ )
+        {
+            __m256i col = r[transposeRow[x]];
+            col = _mm256_or_si256 ( _mm256_and_si256 ( col,even ),_mm256_srli_epi16 ( col,4 ) );
+            col = _mm256_packus_epi16 ( col,zero );
+            _mm_storel_epi64 ( ( __m128i* ) ( out + alphaIndex ( x,y,sz*16 ) /2 ),_mm256_castsi256_si128 ( col ) );
+            _mm_storel_epi64 ( ( __m128i* ) ( out + alphaIndex ( x,y+1,sz*16 ) /2 ),_mm256_extracti128_si256 ( col,1 ) );
+        }
+    }
+}
+
+TARGET_AVX2 void packSectionAVX2 ( const uint8_t *blocks, const uint8_t *data, const uint8_t *sky, const uint8_t *light, int sz,
+                                   uint8_t *outblocks, uint8_t *outdata, uint8_t *outsky, uint8_t *outlight )
+{
+    __m256i r[16];
+    for ( int y=0;y<16;y+=2 )
+    {
+        for ( int z=0;z<16;z++ )
+            r[z] = _mm256_loadu_si256 ( ( const __m256i* ) ( blocks + sectionIndex ( 0,y,z ) ) );
+        transpose16AVX2 ( r );
+        for ( int x=0;x<16;x++ )
+        {
+            __m256i col = r[transposeRow[x]];
+            _mm_storeu_si128 ( ( __m128i* ) ( outblocks + alphaIndex ( x,y,sz*16 ) ),_mm256_castsi256_si128 ( col ) );
+            _mm_storeu_si128 ( ( __m128i* ) ( outblocks + alphaIndex ( x,y+1,sz*16 ) ),_mm256_extracti128_si256 ( col,1 ) );
+        }
+    }
+    packNibblesAVX2 ( data,sz,outdata );
+    packNibblesAVX2 ( sky,sz,outsky );
+    packNibblesAVX2 ( light,sz,outlight );
+}
+#endif
+
+//builds the NBT for one chunk into an empty nbt, touches nothing but its own buffers so can run on any thread
+void packChunk ( const myWorld &world, int cx, int cy, myNBT &nbt )
+{
+    int xpos = cx;
+    int ypos = cy;
+
+    nbt.buf.reserve ( 16*16*CHUNK_HEIGHT*5/2 + 1024 );
+    nbt.compound ( "" );
+    nbt.compound ( "Level" );
+    nbt.list ( "Entities",TAG_COMPOUND,0 );
+    nbt.list ( "TileEntities",TAG_COMPOUND,0 );
+    nbt.tagByte ( "TerrainPopulated",1 );
+    nbt.tagLong ( "LastUpdate",0 );//apparently game time, not unix time
+    nbt.tagInt ( "xPos",xpos );
+    nbt.tagInt ( "zPos",ypos );
+
+
+    //prepair data
+    //every byte is written by the section kernel below, so nothing needs clearing first
+    uint8_t blocks[16*16*CHUNK_HEIGHT];
+    uint8_t data[16*16*CHUNK_HEIGHT/2];
+    uint8_t skylight[16*16*CHUNK_HEIGHT/2];
+    uint8_t blocklight[16*16*CHUNK_HEIGHT/2];
+    char heightmap[16*16];
+    //the height map comes from lighting, it is where the sky stops coming straight down
+    for ( int yy=0;yy<16;yy++ )
+        for ( int xx=0;xx<16;xx++ )
+            heightmap[yy*16 + xx] = min ( world.height ( cx*16+xx,cy*16+yy ),CHUNK_HEIGHT-1 );
+
+    uint8_t secblocks[SECTION_BLOCKS];
+    uint8_t secdata[SECTION_NIBBLES];
+    uint8_t secsky[SECTION_NIBBLES];
+    uint8_t seclight[SECTION_NIBBLES];
+    int top = min ( world.zsize,CHUNK_HEIGHT );
+    for ( int sz=0;sz*16<CHUNK_HEIGHT;sz++ )
+    {
+        const mySection *sec = sz<world.sectionsz ? world.section ( cx,cy,sz ) : NULL;
+        if ( sec==NULL )
+        {
+            //air, nothing but the sky coming in from above
+            memset ( secblocks,0,SECTION_BLOCKS );
+            memset ( secdata,0,SECTION_NIBBLES );
+            memset ( secsky,0,SECTION_NIBBLES );
+            memset ( seclight,0,SECTION_NIBBLES );
+            for ( int yy=0;yy<16;yy++ )
+                for ( int xx=0;xx<16;xx++ )
+                    for ( int zz=max ( world.height ( cx*16+xx,cy*16+yy ),sz*16 );zz<min ( sz*16+16,top );zz++ )
+                        setNibble ( secsky,sectionIndex ( xx,yy,zz ),15 );
+        }
+        else
+            sec->unpack ( secblocks,secdata,secsky,seclight );
+        packSectionFunc ( secblocks,secdata,secsky,seclight,sz,blocks,data,skylight,blocklight );
+
+        //anything above the top of the world is left empty
+        for ( int zz=max ( top,sz*16 );zz<sz*16+16;zz++ )
+        {
+            for ( int yy=0;yy<16;yy++ )
+            {
+                for ( int xx=0;xx<16;xx++ )
                 {
-                    data[index/2] |= ( blockdata & 0xf0 );
-                    skylight[index/2] |= ( ( skyl & 0x0f ) << 4 );
-                    blocklight[index/2] |= ( ( blockl &0x0f ) << 4 );
+                    int index = alphaIndex ( xx,yy,zz );
+                    blocks[index] = 0;
+                    setNibble ( data,index,0 );
+                    setNibble ( skylight,index,0 );
+                    setNibble ( blocklight,index,0 );
                 }
             }
         }
     }
 
-    //blocks
-    write ( of,"\007\000\006Blocks",9 );
-    int isize = 16 * 16 * CHUNK_HEIGHT;
-    val[0] = * ( ( ( char* ) ( &isize ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &isize ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &isize ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &isize ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
-    write ( of, ( char* ) blocks,isize );
-    //data
-    write ( of,"\007\000\004Data",7 );
-    isize = 16 * 16 * CHUNK_HEIGHT/2;
-    val[0] = * ( ( ( char* ) ( &isize ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &isize ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &isize ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &isize ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
-    write ( of, ( char* ) data,isize );
-    //skylight
-    write ( of,"\007\000\010SkyLight",11 );
-    write ( of,val,4 );//same size as above
-    write ( of, ( char* ) skylight,isize );
-    //blocklight
-    write ( of,"\007\000\012BlockLight",13 );
-    write ( of,val,4 );//same size as above
-    write ( of, ( char* ) blocklight,isize );
-    //heightMap
-    write ( of,"\007\000\011HeightMap",12 );
-    isize = 16 * 16;
-    val[0] = * ( ( ( char* ) ( &isize ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &isize ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &isize ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &isize ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
-    write ( of, ( char* ) heightmap,isize );
-
-
-    //now close tag_compound 'level'
-    write ( of,"\000",1 );
-
-    /*  write(of,"\010\000\013GeneratedBy",14);
-    char str[256];
-    strcpy(str,"Dwarf Fortress To Minecraft by TroZ");
-    int len = strlen(str);
-    write(of,((char*)&(len))+1,1);
-    write(of,&(len),1);
-    write(of,str,len);
-    */
-    write ( of,"\000",1 );// end of unnamed compound
+    nbt.tagByteArray ( "Blocks",blocks,16 * 16 * CHUNK_HEIGHT );
+    nbt.tagByteArray ( "Data",data,16 * 16 * CHUNK_HEIGHT/2 );
+    nbt.tagByteArray ( "SkyLight",skylight,16 * 16 * CHUNK_HEIGHT/2 );
+    nbt.tagByteArray ( "BlockLight",blocklight,16 * 16 * CHUNK_HEIGHT/2 );
+    nbt.tagByteArray ( "HeightMap",heightmap,16 * 16 );
+    nbt.end();//level
+    nbt.end();//unnamed compound
+}
 
-    close ( of );
+//Anvil chunk - the column is split into 16x16x16 sections stored y, z, x order, the same order as mySection
+//sections that are nothing but sky lit air are left out, the game fills them in the same way
+bool allNibbles ( const uint8_t *plane, uint8_t fill, uint8_t v )
+{
+    if ( plane==NULL )
+        return fill==v;
+    for ( int i=0;i<SECTION_NIBBLES;i++ )
+        if ( plane[i]!=v*0x11 )
+            return false;
+    return true;
+}
 
+bool skyLitAir ( const mySection *sec )
+{
+    return sec->allAir() && allNibbles ( sec->skylight,sec->skyfill,15 ) && allNibbles ( sec->blocklight,sec->blockfill,0 );
+}
 
-    int res = compressFile (out,"out.mcraw",path );
-    if ( res != Z_OK )
+void packChunkAnvil ( const myWorld &world, int cx, int cy, myNBT &nbt )
+{
+    int32_t heightmap[16*16];
+    int opening = 0;//everything from here up is open sky
+    for ( int i=0;i<16*16;i++ )
     {
-        out.printerr ( "\nError compressing file (%d)\n",res );
+        heightmap[i] = world.height ( cx*16 + ( i&15 ),cy*16 + ( i>>4 ) );
+        opening = max ( opening, ( int ) heightmap[i] );
     }
-    else
-    {
 
-        //now get file size
-        struct stat filestatus;
-        if ( stat ( path,&filestatus ) ==0 )
+    int height = min ( world.zsize,maxHeight );
+    int numsections = ( height + 15 ) /16;
+    std::vector<std::pair<int,const mySection*> > used;//NULL for sections never written to
+    for ( int sz=0;sz<numsections;sz++ )
+    {
+        const mySection *sec = world.section ( cx,cy,sz );
+        if ( height-sz*16 >= 16 && ( sec==NULL ? sz*16>=opening : skyLitAir ( sec ) ) )
+            continue;
+        used.push_back ( std::make_pair ( sz,sec ) );
+    }
+    uint8_t blocks[SECTION_BLOCKS];
+    uint8_t data[SECTION_NIBBLES];
+    uint8_t skylight[SECTION_NIBBLES];
+    uint8_t blocklight[SECTION_NIBBLES];
+
+    nbt.buf.reserve ( used.size() * ( SECTION_BLOCKS+SECTION_NIBBLES*3+64 ) + 2048 );
+    nbt.compound ( "" );
+    nbt.compound ( "Level" );
+    nbt.list ( "Entities",TAG_COMPOUND,0 );
+    nbt.list ( "TileEntities",TAG_COMPOUND,0 );
+    nbt.tagByte ( "TerrainPopulated",1 );
+    nbt.tagLong ( "LastUpdate",0 );
+    nbt.tagInt ( "xPos",cx );
+    nbt.tagInt ( "zPos",cy );
+    nbt.tagIntArray ( "HeightMap",heightmap,16*16 );
+    nbt.list ( "Sections",TAG_COMPOUND, ( int32_t ) used.size() );
+    for ( size_t i=0;i<used.size();i++ )
+    {
+        int sz = used[i].first;
+        const mySection *sec = used[i].second;
+        if ( sec )
         {
-            size = filestatus.st_size;
+            sec->unpack ( blocks,data,skylight,blocklight );
         }
         else
         {
-            out.printerr ( " Error getting file size " );
+            //air that was never written to, dark below the height map and in full sky above it
+            memset ( blocks,0,SECTION_BLOCKS );
+            memset ( data,0,SECTION_NIBBLES );
+            memset ( skylight,0,SECTION_NIBBLES );
+            memset ( blocklight,0,SECTION_NIBBLES );
+            for ( int col=0;col<16*16;col++ )
+                for ( int zz=max ( ( int ) heightmap[col]-sz*16,0 );zz<16;zz++ )
+                    setNibble ( skylight, ( zz<<8 ) | col,15 );
+        }
+        nbt.tagByte ( "Y",sz );
+        nbt.tagByteArray ( "Blocks",blocks,SECTION_BLOCKS );
+        nbt.tagByteArray ( "Data",data,SECTION_NIBBLES );
+        nbt.tagByteArray ( "SkyLight",skylight,SECTION_NIBBLES );
+        nbt.tagByteArray ( "BlockLight",blocklight,SECTION_NIBBLES );
+        nbt.end();
+    }
+    nbt.end();//level
+    nbt.end();//unnamed compound
+}
+
+//region file (McRegion .mcr or Anvil .mca) - 32x32 chunks in one file
+//an 8KB header (sector offset and count of each chunk, then timestamps) followed by the chunks in 4KB sectors
+//chunks go into the file as they arrive and the header is written over the space left for it when the region is
+//closed, so only the headers of the open regions are held in memory
+#define REGION_SECTOR 4096
+
+struct myRegionFile
+{
+    std::vector<uint8_t> header;
+    FILE *f;            //NULL until opened
+    uint32_t sectors;   //in the file so far, the header's two included
+
+    myRegionFile() : f ( NULL ), sectors ( 0 ) {}
+
+    int open ( DFHack::color_ostream & out, const char* dirname, int rx, int ry )
+    {
+        char path[1024];
+        snprintf ( path,1023,"%s/region/r.%d.%d.%s",dirname,rx,ry,outputType==OUTPUT_ANVIL ? "mca" : "mcr" );
+        path[1023]='\0';
+        f = fopen ( path,"wb" );
+        if ( f==NULL )
+        {
+            out.printerr ( "Could not open file for writing, exiting." );
+            return -51;
         }
+        header.assign ( REGION_SECTOR*2, 0 );
+        sectors = 2;
+        if ( fwrite ( &header[0],1,header.size(),f ) != header.size() )
+            return Z_ERRNO;
+        return Z_OK;
+    }
+    int add ( int cx, int cy, const std::vector<uint8_t> &z, uint32_t timestamp )
+    {
+        static const uint8_t padding[REGION_SECTOR] = {0};
+        myPhaseTimer timer ( exportStats.phases[PHASE_WRITE] );
+        uint32_t len = ( uint32_t ) z.size() + 1;//the length includes the compression type byte
+        uint32_t count = ( len + 4 + REGION_SECTOR - 1 ) /REGION_SECTOR;
+        int idx = ( ( cx&31 ) + ( cy&31 ) *32 ) *4;
+
+        uint32_t loc = ( sectors << 8 ) | ( count & 0xff );
+        uint8_t *hdr = &header[idx];
+        hdr[0] = ( uint8_t ) ( loc>>24 );
+        hdr[1] = ( uint8_t ) ( loc>>16 );
+        hdr[2] = ( uint8_t ) ( loc>>8 );
+        hdr[3] = ( uint8_t ) loc;
+        hdr += REGION_SECTOR;
+        hdr[0] = ( uint8_t ) ( timestamp>>24 );
+        hdr[1] = ( uint8_t ) ( timestamp>>16 );
+        hdr[2] = ( uint8_t ) ( timestamp>>8 );
+        hdr[3] = ( uint8_t ) timestamp;
+
+        uint8_t head[5];
+        head[0] = ( uint8_t ) ( len>>24 );
+        head[1] = ( uint8_t ) ( len>>16 );
+        head[2] = ( uint8_t ) ( len>>8 );
+        head[3] = ( uint8_t ) len;
+        head[4] = 2;//zlib
+        size_t pad = ( size_t ) count*REGION_SECTOR - ( len+4 );
+        bool ok = fwrite ( head,1,5,f ) ==5 && fwrite ( &z[0],1,z.size(),f ) ==z.size() && fwrite ( padding,1,pad,f ) ==pad;
+        sectors += count;
+        timer.stop();
+        return ok ? Z_OK : Z_ERRNO;
+    }
+    //writes the header and closes the file, adding its size to totalsize
+    int close ( int64_t &totalsize )
+    {
+        myPhaseTimer timer ( exportStats.phases[PHASE_WRITE] );
+        bool ok = fseek ( f,0,SEEK_SET ) ==0 && fwrite ( &header[0],1,header.size(),f ) ==header.size();
+        ok = fclose ( f ) ==0 && ok;
+        f = NULL;
+        std::vector<uint8_t>().swap ( header );
+        totalsize += ( int64_t ) sectors*REGION_SECTOR;
+        exportStats.bytes += ( int64_t ) sectors*REGION_SECTOR;
+        timer.stop ( 1 );
+        return ok ? Z_OK : Z_ERRNO;
     }
+};
 
-    return res;
+//region files still open, by region x and y; the map keeps them in the order they are written
+struct myRegionSet
+{
+    std::map< std::pair<int,int>, myRegionFile > files;
+
+    //there are only any left here if the export failed part way
+    ~myRegionSet()
+    {
+        int64_t size = 0;
+        for ( std::map< std::pair<int,int>, myRegionFile >::iterator it = files.begin(); it!=files.end(); it++ )
+        {
+            if ( it->second.f!=NULL )
+                it->second.close ( size );
+        }
+    }
+};
+
+//chunks are packed and compressed on the worker threads, and handed to the writer in order through a
+//ring of slots so only a bounded number of compressed chunks are held in memory at once
+struct myChunkSlot
+{
+    std::vector<uint8_t> gz;
+    int pos;    //which position in the write order is in the slot, -1 if empty
+    int res;
+};
+
+struct myChunkStage
+{
+    const myWorld *world;
+    int windowBits;
+    std::vector<int> order; //chunks in the order they are written, chunk n is at x = n/chunksy, y = n%chunksy
+    int chunksy;
+
+    tthread::mutex lock;
+    tthread::condition_variable ready;  //a slot was filled
+    tthread::condition_variable freed;  //the writer finished with a slot
+    myChunkSlot *slots;
+    int numslots;
+    int next;       //next position to be packed
+    int written;    //chunks handed to the writer so far
+    bool abort;
+    myPhaseTime pack;       //added up over the workers as they finish
+    myPhaseTime compress;
+};
+
+void chunkWorker ( void *arg )
+{
+    myChunkStage *st = ( myChunkStage* ) arg;
+    int chunks = ( int ) st->order.size();
+    myNBT nbt;
+    std::vector<uint8_t> gz;
+    myPhaseTime pack;
+    myPhaseTime compress;
+    memset ( &pack,0,sizeof ( pack ) );
+    memset ( &compress,0,sizeof ( compress ) );
+    while ( true )
+    {
+        st->lock.lock();
+        while ( !st->abort && st->next < chunks && st->next >= st->written + st->numslots )
+            st->freed.wait ( st->lock );
+        if ( st->abort || st->next >= chunks )
+        {
+            st->pack.add ( pack );
+            st->compress.add ( compress );
+            st->lock.unlock();
+            return;
+        }
+        int pos = st->next++;
+        st->lock.unlock();
+
+        int chunk = st->order[pos];
+        int res;
+        try
+        {
+            myPhaseTimer packTimer ( pack,false );
+            nbt.buf.clear();
+            if ( outputType==OUTPUT_ANVIL )
+                packChunkAnvil ( *st->world, chunk/st->chunksy, chunk%st->chunksy, nbt );
+            else
+                packChunk ( *st->world, chunk/st->chunksy, chunk%st->chunksy, nbt );
+            packTimer.stop ( 1 );
+
+            myPhaseTimer compressTimer ( compress,false );
+            res = deflateBuffer ( nbt.buf, gz, compression->level, compression->strategy, st->windowBits );
+            compressTimer.stop ( 1 );
+        }
+        catch ( std::bad_alloc & )
+        {
+            //a bad_alloc leaving the thread would terminate Dwarf Fortress, the writer throws it again instead
+            res = Z_MEM_ERROR;
+        }
+
+        st->lock.lock();
+        myChunkSlot &slot = st->slots[pos%st->numslots];
+        slot.gz.swap ( gz );//the slot's old buffer comes back for reuse
+        slot.res = res;
+        slot.pos = pos;
+        st->ready.notify_all();
+        st->lock.unlock();
+    }
 }
 
-int saveMCLevelAlpha ( DFHack::color_ostream & out, uint8_t* mclayers,uint8_t* mcdata,uint8_t* mcskylight,uint8_t* mcblocklight,int mcxsquares,int mcysquares,int mczsquares, int xs, int ys, int zs,char* name )
+//saves the chunk columns from cx0 up to cx1, region files are written once their last column is in
+int saveChunks ( DFHack::color_ostream & out, char* dirname, const myWorld &world, int cx0, int cx1, myRegionSet &regions, int64_t &totalsize )
 {
+    myChunkStage st;
+    st.world = &world;
+    st.windowBits = outputType==OUTPUT_ALPHA ? GZIP_WINDOW : ZLIB_WINDOW;
+    st.chunksy = world.chunksy;
+    for ( int cx=cx0;cx<cx1;cx++ )
+        for ( int cy=0;cy<st.chunksy;cy++ )
+            st.order.push_back ( cx*st.chunksy + cy );
+    int chunks = ( int ) st.order.size();
+    st.next = 0;
+    st.written = 0;
+    st.abort = false;
+    memset ( &st.pack,0,sizeof ( st.pack ) );
+    memset ( &st.compress,0,sizeof ( st.compress ) );
+
+    int workers = max ( 1,min ( getThreadCount(),chunks ) );
+    st.numslots = workers*4;
+    st.slots = new myChunkSlot[st.numslots];
+    for ( int i=0;i<st.numslots;i++ )
+        st.slots[i].pos = -1;
+
+    //running out of memory anywhere in here has to wait until the workers are stopped and joined before it is
+    //thrown again, they are using st and the world
+    bool outOfMemory = false;
+    std::vector<tthread::thread*> threads;
+    threads.reserve ( workers );
+    int res = 0;
+    try
+    {
+        for ( int i=0;i<workers;i++ )
+        {
+            threads.push_back ( new tthread::thread ( chunkWorker, &st ) );
+        }
 
-    out.print ( "\n\nSaving...\n" );
+        //this thread is the writer, it takes the chunks in order so the output is the same however many threads are used
+        char path[1024];
+        std::vector<uint8_t> gz;
+        uint32_t timestamp = ( uint32_t ) time ( NULL );
+        for ( int pos=0;pos<chunks && res==0;pos++ )
+        {
+            int chunk = st.order[pos];
+            int cx = chunk/st.chunksy;
+            int cy = chunk%st.chunksy;
+            if ( pos%st.chunksy==0 )
+                out.print ( "." );
+
+            st.lock.lock();
+            myChunkSlot &slot = st.slots[pos%st.numslots];
+            while ( slot.pos != pos )
+                st.ready.wait ( st.lock );
+            gz.swap ( slot.gz );
+            res = slot.res;
+            slot.pos = -1;
+            st.lock.unlock();
+
+            if ( res == Z_MEM_ERROR )
+            {
+                outOfMemory = true;
+            }
+            else if ( res != Z_OK )
+            {
+                out.printerr ( "\nError compressing file (%d)\n",res );
+            }
+            else if ( outputType==OUTPUT_ALPHA )
+            {
+                res = chunkPath ( dirname, cx*16, cy*16, path );
+                if ( res==0 )
+                    res = writeFile ( out, path, gz );
+                totalsize += gz.size();
+            }
+            else
+            {
+                myRegionFile &region = regions.files[std::make_pair ( cx>>5, cy>>5 )];
+                if ( region.f==NULL )
+                    res = region.open ( out, dirname, cx>>5, cy>>5 );
+                if ( res==0 )
+                    res = region.add ( cx, cy, gz, timestamp );
+            }
 
-    zs++;//I think this is needed - still need to test
+            st.lock.lock();
+            st.written++;
+            if ( res != 0 )
+                st.abort = true;
+            st.freed.notify_all();
+            st.lock.unlock();
+        }
+        //regions that no later column reaches into are complete
+        std::map< std::pair<int,int>, myRegionFile >::iterator it = regions.files.begin();
+        while ( res==0 && it!=regions.files.end() )
+        {
+            if ( cx1>=world.chunksx || ( it->first.first+1 ) *32 <= cx1 )
+            {
+                res = it->second.close ( totalsize );
+                regions.files.erase ( it++ );
+            }
+            else
+                it++;
+        }
+    }
+    catch ( std::bad_alloc & )
+    {
+        outOfMemory = true;
+    }
+    if ( outOfMemory )
+    {
+        st.lock.lock();
+        st.abort = true;
+        st.freed.notify_all();
+        st.lock.unlock();
+    }
 
-    char dirname[256];
+    for ( size_t i=0;i<threads.size();i++ )
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+    delete[] st.slots;
+
+    //the workers run side by side, so these are thread time rather than time off the clock
+    exportStats.phases[PHASE_PACK].add ( st.pack );
+    exportStats.phases[PHASE_COMPRESS].add ( st.compress );
+
+    if ( outOfMemory )
+        throw std::bad_alloc();
+    return res;
+}
+
+//picks the first unused "World N" directory name and creates it, with the region folder if one is needed
+int makeLevelDir ( char* name, char* dirname )
+{
     char tempname[250];
     if ( name==NULL || strlen ( name ) <1 )
     {
@@ -955,187 +3170,92 @@ int saveMCLevelAlpha ( DFHack::color_ostream & out, uint8_t* mclayers,uint8_t* m
     {
         return -1;
     }
-
-    int64_t totalsize = 0;
-    int64_t size = 0;
-
-    //ok iterate through 16x16 blocks and save individual chunck files off
-    for ( int x=0;x<mcxsquares;x+=16 )
+    if ( outputType!=OUTPUT_ALPHA )
     {
-        out.print ( "." );
-        for ( int y=0;y<mcysquares;y+=16 )
-        {
-            size = 0;
-            int ret = saveChunk ( out, dirname, mclayers, mcdata, mcskylight, mcblocklight, mcxsquares, mcysquares, mczsquares, x, y, size );
-            if ( ret != 0 )
-            {
-                out.print ( "Error writing file!\n" );
-                return ret;
-            }
-            else
-            {
-                totalsize += size;
-            }
-        }
+        char regiondir[300];
+        snprintf ( regiondir,299,"%s/region",dirname );
+        if ( make_dir ( regiondir ) !=0 )
+            return -1;
     }
+    return 0;
+}
 
+//the chunks are saved as the world is converted, this writes level.dat once they are all done
+int saveLevelDat ( DFHack::color_ostream & out, char* dirname, int xs, int ys, int zs, int64_t totalsize )
+{
+    zs++;//I think this is needed - still need to test
 
-    //now save the main index.dat
-    int of = open ( "out.mcraw",O_BINARY | _O_CREAT | _O_TRUNC | _O_WRONLY,_S_IREAD | _S_IWRITE );
-
-    //first write the raw file to disk
-    write ( of,"\012\000\000\012\000\004Data\001\000\013SnowCovered",24 );
+    //now save the main level.dat
+    myNBT nbt;
+    nbt.compound ( "" );
+    nbt.compound ( "Data" );
     if ( snowy==0 )
-        write ( of, ( ( char* ) ( &biome ) ),1 );
-    else if ( snowy>0 )
-    {
-        write ( of, ( ( char* ) 1 ),1 );
-    }
+        nbt.tagByte ( "SnowCovered",( uint8_t ) biome );
     else
-    {
-        write ( of, ( ( char* ) 0 ),1 );
-    }
-    write ( of,"\004\000\012LastPlayed",13 );
+        nbt.tagByte ( "SnowCovered",snowy>0 ? 1 : 0 );
     int64_t timer = 0;
     // FIXME: not 64-bit on linux. Will fail in year 2038. I think this is not urgent :P
     timer = time(NULL);
     timer *= 1000; //java stores time in milliseconds
-    write ( of, ( ( char* ) ( &timer ) ) +7,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +6,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +5,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +4,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +3,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +2,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +1,1 );
-    write ( of, ( ( char* ) ( &timer ) ) +0,1 );
-
-    write ( of,"\004\000\004Time\000\000\000\000\000\000\000\000\004\000\012RandomSeed",28 );
-
-    char val[9];
-    val[0] = * ( ( ( char* ) ( &seed ) ) +7 );
-    val[1] = * ( ( ( char* ) ( &seed ) ) +6 );
-    val[2] = * ( ( ( char* ) ( &seed ) ) +5 );
-    val[3] = * ( ( ( char* ) ( &seed ) ) +4 );
-    val[4] = * ( ( ( char* ) ( &seed ) ) +3 );
-    val[5] = * ( ( ( char* ) ( &seed ) ) +2 );
-    val[6] = * ( ( ( char* ) ( &seed ) ) +1 );
-    val[7] = * ( ( ( char* ) ( &seed ) ) +0 );
-    val[8] = '\0';
-    write ( of,val,8 );
-
-    write ( of,"\012\000\006Player\002\000\006Health\000\024\001\000\010OnGround\001\002\000\003Air\001\000\002\000\004Fire\xff\xec\002\000\010HurtTime\000\000\002\000\011DeathTime\000\000\002\000\012AttackTime\000\000\003\000\005Score\000\000\000\000\005\000\014FallDistance\000\000\000\000\011\000\011Inventory\012",135 );
+    nbt.tagLong ( "LastPlayed",timer );
+    nbt.tagLong ( "Time",0 );
+    nbt.tagLong ( "RandomSeed",seed );
+
+    nbt.compound ( "Player" );
+    nbt.tagShort ( "Health",20 );
+    nbt.tagByte ( "OnGround",1 );
+    nbt.tagShort ( "Air",256 );
+    nbt.tagShort ( "Fire",-20 );
+    nbt.tagShort ( "HurtTime",0 );
+    nbt.tagShort ( "DeathTime",0 );
+    nbt.tagShort ( "AttackTime",0 );
+    nbt.tagInt ( "Score",0 );
+    nbt.tagFloat ( "FallDistance",0 );
     short entid[] = {276,277,278,279,293,261,345,280,263,282,262,310,311,312,313};
     char entcnt[] = {1, 1,  1,  1,  1,  1,  1,  64, 64, 64, 64, 1,  1,  1,  1};
     char entpos[] = {1, 2,  3,  4,  5,  6,  8,  18, 19, 20, 21, 27, 28, 29, 30};
     int numinv = 15;
-    val[0] = * ( ( ( char* ) ( &numinv ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &numinv ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &numinv ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &numinv ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
+    nbt.list ( "Inventory",TAG_COMPOUND,numinv );
     for ( int i=0;i<numinv;i++ )
     {
-        write ( of,"\002\000\002id",5 );
-        write ( of, ( ( char* ) & ( entid[i] ) ) +1,1 );
-        write ( of,& ( entid[i] ),1 );
-        write ( of,"\001\000\005Count",8 );
-        write ( of,&entcnt[i],1 );
-        write ( of,"\001\000\004Slot",7 );
-        write ( of,&entpos[i],1 );
-        write ( of,"\002\000\005Damage\000\000",10 );
-        write ( of,"\000",1 );
-    }
-    write ( of,"\011\000\003Pos\006\000\000\000\003",11 );
-    double xf = ( double ) xs + 0.5;
-    double yf = ( double ) ys + 0.5;
-    double zf = ( double ) zs + 0.05;
-    //float negxf = -xf;
-    val[0] = * ( ( ( char* ) & ( xf ) ) +7 );
-    val[1] = * ( ( ( char* ) & ( xf ) ) +6 );
-    val[2] = * ( ( ( char* ) & ( xf ) ) +5 );
-    val[3] = * ( ( ( char* ) & ( xf ) ) +4 );
-    val[4] = * ( ( ( char* ) & ( xf ) ) +3 );
-    val[5] = * ( ( ( char* ) & ( xf ) ) +2 );
-    val[6] = * ( ( ( char* ) & ( xf ) ) +1 );
-    val[7] = * ( ( ( char* ) & ( xf ) ) +0 );
-    write ( of,val,8 );
-    val[0] = * ( ( ( char* ) & ( zf ) ) +7 );
-    val[1] = * ( ( ( char* ) & ( zf ) ) +6 );
-    val[2] = * ( ( ( char* ) & ( zf ) ) +5 );
-    val[3] = * ( ( ( char* ) & ( zf ) ) +4 );
-    val[4] = * ( ( ( char* ) & ( zf ) ) +3 );
-    val[5] = * ( ( ( char* ) & ( zf ) ) +2 );
-    val[6] = * ( ( ( char* ) & ( zf ) ) +1 );
-    val[7] = * ( ( ( char* ) & ( zf ) ) +0 );
-    write ( of,val,8 );
-    val[0] = * ( ( ( char* ) & ( yf ) ) +7 );
-    val[1] = * ( ( ( char* ) & ( yf ) ) +6 );
-    val[2] = * ( ( ( char* ) & ( yf ) ) +5 );
-    val[3] = * ( ( ( char* ) & ( yf ) ) +4 );
-    val[4] = * ( ( ( char* ) & ( yf ) ) +3 );
-    val[5] = * ( ( ( char* ) & ( yf ) ) +2 );
-    val[6] = * ( ( ( char* ) & ( yf ) ) +1 );
-    val[7] = * ( ( ( char* ) & ( yf ) ) +0 );
-    write ( of,val,8 );
-    write ( of,"\011\000\010Rotation\005\000\000\000\002\000\000\000\000\000\000\000\000",24 );
-    write ( of,"\011\000\006Motion\006\000\000\000\003\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000",38 );
-    write ( of,"\000",1 );
-
-    write ( of,"\003\000\006SpawnX",9 );
-    val[0] = * ( ( ( char* ) ( &xs ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &xs ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &xs ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &xs ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
-    write ( of,"\003\000\006SpawnY",9 );
-    val[0] = * ( ( ( char* ) ( &zs ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &zs ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &zs ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &zs ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
-    //int negx = -xs;
-    write ( of,"\003\000\006SpawnZ",9 );
-    val[0] = * ( ( ( char* ) ( &ys ) ) +3 );
-    val[1] = * ( ( ( char* ) ( &ys ) ) +2 );
-    val[2] = * ( ( ( char* ) ( &ys ) ) +1 );
-    val[3] = * ( ( ( char* ) ( &ys ) ) +0 );
-    val[4] = '\0';
-    write ( of,val,4 );
-
-    write ( of,"\004\000\012SizeOnDisk",13 );
-    val[0] = * ( ( ( char* ) ( &totalsize ) ) +7 );//this is the total size of the chunk files, does not include this files size, nor disk space for directories
-    val[1] = * ( ( ( char* ) ( &totalsize ) ) +6 );
-    val[2] = * ( ( ( char* ) ( &totalsize ) ) +5 );
-    val[3] = * ( ( ( char* ) ( &totalsize ) ) +4 );
-    val[4] = * ( ( ( char* ) ( &totalsize ) ) +3 );
-    val[5] = * ( ( ( char* ) ( &totalsize ) ) +2 );
-    val[6] = * ( ( ( char* ) ( &totalsize ) ) +1 );
-    val[7] = * ( ( ( char* ) ( &totalsize ) ) +0 );
-    val[8] = '\0';
-    write ( of,val,8 );
-
-    write ( of,"\000",1 );//end of data coumpound
-
-    write ( of,"\010\000\013GeneratedBy",14 );
-    char str[256];
-    strcpy ( str,"Dwarf Fortress To Minecraft by TroZ" );
-    int len = strlen ( str );
-    write ( of, ( ( char* ) & ( len ) ) +1,1 );
-    write ( of,& ( len ),1 );
-    write ( of,str,len );
-
-    write ( of,"\000",1 );// end of unnamed compound
-
-
-    close ( of );
+        nbt.tagShort ( "id",entid[i] );
+        nbt.tagByte ( "Count",entcnt[i] );
+        nbt.tagByte ( "Slot",entpos[i] );
+        nbt.tagShort ( "Damage",0 );
+        nbt.end();
+    }
+    //MC's y is up
+    nbt.list ( "Pos",TAG_DOUBLE,3 );
+    nbt.beDouble ( ( double ) xs + 0.5 );
+    nbt.beDouble ( ( double ) zs + 0.05 );
+    nbt.beDouble ( ( double ) ys + 0.5 );
+    nbt.list ( "Rotation",TAG_FLOAT,2 );
+    nbt.be32 ( 0 );
+    nbt.be32 ( 0 );
+    nbt.list ( "Motion",TAG_DOUBLE,3 );
+    nbt.be64 ( 0 );
+    nbt.be64 ( 0 );
+    nbt.be64 ( 0 );
+    nbt.end();//player
+
+    nbt.tagInt ( "SpawnX",xs );
+    nbt.tagInt ( "SpawnY",zs );
+    nbt.tagInt ( "SpawnZ",ys );
+    nbt.tagLong ( "SizeOnDisk",totalsize );//this is the total size of the chunk files, does not include this files size, nor disk space for directories
+    if ( outputType!=OUTPUT_ALPHA )
+    {
+        nbt.tagInt ( "version",outputType==OUTPUT_ANVIL ? ANVIL_VERSION : MCREGION_VERSION );
+        nbt.tagString ( "LevelName",dirname );
+    }
+    nbt.end();//end of data coumpound
+
+    nbt.tagString ( "GeneratedBy","Dwarf Fortress To Minecraft by TroZ" );
+    nbt.end();// end of unnamed compound
 
     char filename[512];
     snprintf ( filename,511,"%s/%s",dirname,"level.dat" );
     filename[511]='\0';
-    int res = compressFile ( out, "out.mcraw",filename );
+    int res = saveCompressed ( out, filename, nbt );
     if ( res != Z_OK )
     {
         out.printerr ( "\nError compressing file (%d)\n",res );
@@ -1149,125 +3269,395 @@ int saveMCLevelAlpha ( DFHack::color_ostream & out, uint8_t* mclayers,uint8_t* m
     return res;
 }
 
-int getLight ( uint8_t *light,int xmax, int ymax, int zmax, int x, int y , int z, bool isSky )
+//light is spread out from its sources with a queue for each light level, brightest first, so a block is finished
+//the first time it comes off the queue and only the blocks light actually reaches are ever looked at
+//each chunk column spreads its own light on its own thread, light that crosses into another chunk column is handed
+//to it between rounds until no more crosses - the light of a block is the brightest any path brings it, so this
+//ends in the same place whichever order it is done in
+//light crossing into another chunk column, only that column's own thread looks at the block it goes into
+struct myLightUpdate
+{
+    int x, y, z;
+    uint8_t light;  //of the block it comes from
+    bool isSky;
+};
+
+struct myLightQueue
 {
+    const myWorld *world;
+    int x0, x1, y0, y1;     //the chunk column this queue lights
+    int wx0, wx1;           //the slice being lit, the columns either side of it are only read
+    bool isSky;
+    std::vector<uint32_t> levels[16];   //blocks waiting to spread their light, by the light they had when queued
+    std::vector<myLightUpdate> *outbox; //light going into other chunk columns
 
-    //is it out of bounds?
-    if ( x<0 || y<0 || z<0 || x>=xmax || y>=ymax )
+    uint32_t pos ( int x, int y, int z ) const
     {
-        return 0;
+        return ( ( uint32_t ) ( ( x-x0 ) *16 + ( y-y0 ) ) ) *world->zsize + z;
     }
-    if ( z>=zmax )
+    uint8_t get ( int x, int y, int z ) const
     {
-        if ( isSky )
-        {
+        return isSky ? world->getSkyLight ( x,y,z ) : world->getBlockLight ( x,y,z );
+    }
+    //partially lit blocks are lit separately at the end, light never goes through them
+    int opacity ( int x, int y, int z ) const
+    {
+        int blocktype = world->getBlock ( x,y,z );
+        if ( cubePartialLit[blocktype] )
             return 15;
-        }
-        else
-        {
-            return 0;
-        }
+        return isSky ? cubeSkyOpacity[blocktype] : max ( cubeBlockOpacity[blocktype],0 );
+    }
+    void push ( int x, int y, int z, uint8_t light )
+    {
+        levels[light].push_back ( pos ( x,y,z ) );
     }
+};
 
-    int index = x + ( z * ymax +y ) * xmax;
-    return light[index];
+inline void setLight ( myWorld &world, myLightQueue &q, int x, int y, int z, uint8_t light )
+{
+    if ( q.isSky )
+        world.setSkyLight ( x,y,z,light );
+    else
+        world.setBlockLight ( x,y,z,light );
+    q.push ( x,y,z,light );
+}
+
+//every step costs at least one level, or the block's opacity if that is more - except sky light going
+//straight down through clear blocks, which stays at full strength as in Minecraft
+inline void spreadTo ( myWorld &world, myLightQueue &q, int x, int y, int z, int light, bool down )
+{
+    if ( x<q.wx0 || x>=q.wx1 || y<0 || y>=world.ysize || z<0 || z>=world.zsize )
+        return;
+    if ( x<q.x0 || x>=q.x1 || y<q.y0 || y>=q.y1 )
+    {
+        myLightUpdate u = { x, y, z, ( uint8_t ) light, q.isSky };
+        q.outbox->push_back ( u );
+        return;
+    }
+    int opacity = q.opacity ( x,y,z );
+    if ( opacity>=15 )
+        return;
+    if ( ! ( down && light==15 && opacity==0 ) )
+        light -= max ( opacity,1 );
+    if ( light>0 && light>q.get ( x,y,z ) )
+        setLight ( world, q, x,y,z,light );
 }
 
-inline void lightCubeSky ( uint8_t *mcskylight, int xmax, int ymax, int zmax, int x, int y, int z, int opacity, int index )
+void spreadLight ( myWorld &world, myLightQueue &q )
 {
-    int skylightvert=max ( getLight ( mcskylight,xmax, ymax, zmax, x, y , z+1, true ),getLight ( mcskylight,xmax, ymax, zmax, x, y , z-1, true ) );
-    int skylighthoriz = max (
-                            max ( getLight ( mcskylight,xmax, ymax, zmax, x+1, y , z, true ),getLight ( mcskylight,xmax, ymax, zmax, x-1, y , z, true ) ),
-                            max ( getLight ( mcskylight,xmax, ymax, zmax, x, y+1 , z, true ),getLight ( mcskylight,xmax, ymax, zmax, x, y-1 , z, true ) ) );
-    skylighthoriz = ( skylighthoriz>0 ) ?skylighthoriz-1:0;
-    int skylight = max ( skylightvert, skylighthoriz );
-    if ( opacity>0 )
+    int zsize = world.zsize;
+    for ( int level=15;level>1;level-- )
     {
-        skylight=max ( skylight-opacity,0 );
+        //spreading only ever adds to dimmer levels, or to this one for sky light going down
+        std::vector<uint32_t> &queue = q.levels[level];
+        for ( size_t i=0;i<queue.size();i++ )
+        {
+            uint32_t p = queue[i];
+            int z = p%zsize;
+            int y = ( p/zsize ) %16 + q.y0;
+            int x = ( int ) ( p/zsize/16 ) + q.x0;
+            if ( q.get ( x,y,z ) !=level )
+                continue;//since made brighter, and queued again at that level
+            spreadTo ( world, q, x+1, y, z, level, false );
+            spreadTo ( world, q, x-1, y, z, level, false );
+            spreadTo ( world, q, x, y+1, z, level, false );
+            spreadTo ( world, q, x, y-1, z, level, false );
+            spreadTo ( world, q, x, y, z+1, level, false );
+            spreadTo ( world, q, x, y, z-1, level, true );
+        }
+        std::vector<uint32_t>().swap ( queue );
     }
-    mcskylight[index] = skylight;
+    std::vector<uint32_t>().swap ( q.levels[1] );
+    std::vector<uint32_t>().swap ( q.levels[0] );
 }
 
-inline void lightCubeBlock ( uint8_t *mcblocklight, int xmax, int ymax, int zmax, int x, int y, int z, int opacity, int index )
+//a partially lit block (slabs, stairs) does not let light through, but takes the light of its brightest neighbour
+//other than partially lit ones, so it doesn't matter which of those is done first
+inline int partialLight ( const myLightQueue &q, int x, int y, int z )
 {
-    int blocklightvert=max ( getLight ( mcblocklight,xmax, ymax, zmax, x, y , z+1, false ),getLight ( mcblocklight,xmax, ymax, zmax, x, y , z-1, false ) );
-    int blocklighthoriz = max (
-                              max ( getLight ( mcblocklight,xmax, ymax, zmax, x+1, y , z, false ),getLight ( mcblocklight,xmax, ymax, zmax, x-1, y , z, false ) ),
-                              max ( getLight ( mcblocklight,xmax, ymax, zmax, x, y+1 , z, false ),getLight ( mcblocklight,xmax, ymax, zmax, x, y-1 , z, false ) ) );
-
-    int blocklight = max ( max ( blocklightvert, blocklighthoriz ),getLight ( mcblocklight,xmax, ymax, zmax, x, y , z, false ) );
-    if ( opacity>=0 )
-    {
-        blocklight=max ( blocklight-opacity-1,0 );
+    const myWorld &world = *q.world;
+    int light = 0;
+    int dx[6] = { 1,-1,0,0,0,0 };
+    int dy[6] = { 0,0,1,-1,0,0 };
+    int dz[6] = { 0,0,0,0,1,-1 };
+    for ( int d=0;d<6;d++ )
+    {
+        int nx = x+dx[d];
+        int ny = y+dy[d];
+        int nz = z+dz[d];
+        int l;
+        if ( nz>=world.zsize )
+            l = q.isSky ? 15 : 0;
+        else if ( !world.inside ( nx,ny,nz ) || cubePartialLit[world.getBlock ( nx,ny,nz )] )
+            l = 0;
+        else
+            l = q.get ( nx,ny,nz );
+        if ( ! ( q.isSky && d==4 && l==15 ) )
+            l--;
+        light = max ( light,l );
     }
-    mcblocklight[index] = blocklight;
+    return light;
 }
 
-void calcLighting ( DFHack::color_ostream & out, uint8_t *mclayers,uint8_t *mcskylight,uint8_t *mcblocklight, int xmax, int ymax, int zmax )
+//one chunk column's share of the lighting
+struct myChunkLight
+{
+    myLightQueue sky, block;
+    std::vector<myLightUpdate> inbox, outbox;
+    std::vector<uint32_t> partial;      //partially lit blocks, by queue position
+    std::vector<uint8_t> partialLit;    //and the sky and block light they get, two to a block
+};
+
+#define LIGHT_CLEAR     0   //clear the old light and fill in the sky above the height map
+#define LIGHT_SEED      1   //queue the light sources and spread them
+#define LIGHT_EXCHANGE  2   //take the light the neighbours passed over and spread that
+#define LIGHT_PARTIAL   3   //work out the light of the partially lit blocks
+#define LIGHT_APPLY     4   //and set it, once nothing else is reading
+
+struct myLightJob
 {
+    myWorld *world;
+    int cx0;
+    int stage;
+    std::vector<myChunkLight> chunks;   //chunk columns being lit, x then y
+};
 
-    out.print ( "\nCalculating lighting...\n" );
+void clearChunkLight ( myWorld &world, int cx, int cy, myLightQueue &sky )
+{
+    for ( int sz=0;sz<world.sectionsz;sz++ )
+        if ( world.section ( cx,cy,sz ) )
+            world.section ( cx,cy,sz )->clearLight();
 
-    for ( int pass=15;pass>0;pass-- )
+    //sky light comes straight down each column until something stops it - that is the height map
+    uint16_t *h = world.chunkHeights ( cx,cy );
+    for ( int y=cy*16;y<cy*16+16;y++ )
     {
-        out.print ( "." );
-        for ( int z=zmax-1;z>-1;z-- )
+        for ( int x=cx*16;x<cx*16+16;x++ )
         {
-            for ( int y=0;y<ymax;y++ )
+            int z = world.zsize-1;
+            while ( z>=0 )
             {
-                for ( int x=0;x<xmax;x++ )
+                if ( world.get ( x,y,z ) ==NULL )
                 {
+                    z = ( z&~15 )-1;//air all the way through
+                    continue;
+                }
+                if ( sky.opacity ( x,y,z ) >0 )
+                    break;
+                z--;
+            }
+            h[ ( ( y&15 ) <<4 ) | ( x&15 )] = ( uint16_t ) ( z+1 );
 
-                    int index = x + ( z * ymax +y ) * xmax;
-                    int blocktype = mclayers[index];
+            //a block that only dims the sky lets some of it further down
+            if ( z>=0 && sky.opacity ( x,y,z ) <15 )
+                setLight ( world, sky, x,y,z,15-sky.opacity ( x,y,z ) );
+        }
+    }
 
-                    //calc skylight
-                    int opacity = cubeSkyOpacity[blocktype];
-                    if ( opacity<15 )
-                    {
-                        lightCubeSky ( mcskylight, xmax, ymax, zmax, x, y, z,opacity, index );
-                    }
+    //fill in everything above the height map in one go, a section at a time
+    int opening = 0;//everything from here up is open sky
+    for ( int i=0;i<16*16;i++ )
+        opening = max ( opening, ( int ) h[i] );
+    for ( int sz=0;sz<world.sectionsz;sz++ )
+    {
+        mySection *sec = world.section ( cx,cy,sz );
+        if ( sec==NULL )
+            continue;//reads as sky lit already
+        if ( opening<=sz*16 )
+        {
+            sec->skyfill = 15;//every column is open all the way through, and the section has just been cleared
+            continue;
+        }
+        for ( int i=0;i<16*16;i++ )
+        {
+            for ( int z=max ( ( int ) h[i],sz*16 );z<sz*16+16;z++ )
+                sec->setSky ( ( ( z&15 ) <<8 ) | i,15 );
+        }
+    }
+}
 
-                    //calc blocklight
-                    opacity = cubeBlockOpacity[blocktype];
-                    if ( opacity<0 )
-                    {
-                        mcblocklight[index] = -opacity;
-                        lightCubeBlock ( mcblocklight, xmax, ymax, zmax, x, y, z, opacity, index );
-                    }
-                    else if ( opacity<15 )
-                    {
-                        lightCubeBlock ( mcblocklight, xmax, ymax, zmax, x, y, z, opacity, index );
-                    }
-                }
-            }
+void seedChunkLight ( myWorld &world, int cx, int cy, myChunkLight &cl )
+{
+    myLightQueue &sky = cl.sky;
+    myLightQueue &block = cl.block;
+
+    //only the part of a column higher up than a neighbour's opening lights anything sideways
+    for ( int y=cy*16;y<cy*16+16;y++ )
+    {
+        for ( int x=cx*16;x<cx*16+16;x++ )
+        {
+            int h = world.height ( x,y );
+            int top = h;
+            if ( x>sky.wx0 )
+                top = max ( top,world.height ( x-1,y ) );
+            if ( x+1<sky.wx1 )
+                top = max ( top,world.height ( x+1,y ) );
+            if ( y>0 )
+                top = max ( top,world.height ( x,y-1 ) );
+            if ( y+1<world.ysize )
+                top = max ( top,world.height ( x,y+1 ) );
+            for ( int z=h;z<top;z++ )
+                sky.push ( x,y,z,15 );
         }
     }
 
-    //final pass - fill only the partially lit objects
-    out.print ( " ." );
-    for ( int z=zmax-1;z>-1;z-- )
+    //block light from the blocks that give it off - they have a negative opacity, which is how bright they are
+    //they were noted down as they were put in the world, along with the partially lit ones; one may since have
+    //been covered by something else, or noted twice, so it is checked here
+    const std::vector<uint32_t> &noted = world.lightBlocks[cx*world.chunksy + cy];
+    for ( size_t i=0;i<noted.size();i++ )
+    {
+        int x = cx*16 + ( noted[i]&15 );
+        int y = cy*16 + ( ( noted[i]>>4 ) &15 );
+        int z = noted[i]>>8;
+        int blocktype = world.getBlock ( x,y,z );
+        if ( cubeBlockOpacity[blocktype]<0 && -cubeBlockOpacity[blocktype]>world.getBlockLight ( x,y,z ) )
+            setLight ( world, block, x,y,z,-cubeBlockOpacity[blocktype] );
+        if ( cubePartialLit[blocktype] )
+            cl.partial.push_back ( block.pos ( x,y,z ) );
+    }
+
+    //the columns either side of the slice that are inside the world already have their light, which comes in from there
+    int edges[2] = { sky.wx0, sky.wx1-1 };
+    int froms[2] = { sky.wx0-1, sky.wx1 };
+    for ( int e=0;e<2;e++ )
     {
-        for ( int y=0;y<ymax;y++ )
+        int edge = edges[e];
+        int from = froms[e];
+        if ( edge<cx*16 || edge>=cx*16+16 || from<0 || from>=world.xsize )
+            continue;
+        for ( int y=cy*16;y<cy*16+16;y++ )
         {
-            for ( int x=0;x<zmax;x++ )
+            for ( int z=0;z<world.zsize;z++ )
             {
+                if ( cubePartialLit[world.getBlock ( from,y,z )] )
+                    continue;
+                uint8_t light = world.getSkyLight ( from,y,z );
+                if ( light>1 )
+                    spreadTo ( world, sky, edge,y,z,light,false );
+                light = world.getBlockLight ( from,y,z );
+                if ( light>1 )
+                    spreadTo ( world, block, edge,y,z,light,false );
+            }
+        }
+    }
+}
+
+void lightChunk ( void *arg, int item, int /*worker*/ )
+{
+    myLightJob *job = ( myLightJob* ) arg;
+    myWorld &world = *job->world;
+    myChunkLight &cl = job->chunks[item];
+    int cx = job->cx0 + item/world.chunksy;
+    int cy = item%world.chunksy;
+    switch ( job->stage )
+    {
+    case LIGHT_CLEAR:
+        clearChunkLight ( world, cx, cy, cl.sky );
+        break;
+    case LIGHT_SEED:
+        seedChunkLight ( world, cx, cy, cl );
+        spreadLight ( world, cl.sky );
+        spreadLight ( world, cl.block );
+        break;
+    case LIGHT_EXCHANGE:
+        for ( size_t i=0;i<cl.inbox.size();i++ )
+        {
+            const myLightUpdate &u = cl.inbox[i];
+            spreadTo ( world, u.isSky ? cl.sky : cl.block, u.x,u.y,u.z,u.light,false );//always sideways
+        }
+        std::vector<myLightUpdate>().swap ( cl.inbox );
+        spreadLight ( world, cl.sky );
+        spreadLight ( world, cl.block );
+        break;
+    case LIGHT_PARTIAL:
+        cl.partialLit.resize ( cl.partial.size() *2 );
+        for ( size_t i=0;i<cl.partial.size();i++ )
+        {
+            uint32_t p = cl.partial[i];
+            int z = p%world.zsize;
+            int y = ( p/world.zsize ) %16 + cy*16;
+            int x = ( int ) ( p/world.zsize/16 ) + cx*16;
+            cl.partialLit[i*2] = ( uint8_t ) max ( partialLight ( cl.sky, x,y,z ),0 );
+            cl.partialLit[i*2+1] = ( uint8_t ) max ( partialLight ( cl.block, x,y,z ),0 );
+        }
+        break;
+    case LIGHT_APPLY:
+        for ( size_t i=0;i<cl.partial.size();i++ )
+        {
+            uint32_t p = cl.partial[i];
+            int z = p%world.zsize;
+            int y = ( p/world.zsize ) %16 + cy*16;
+            int x = ( int ) ( p/world.zsize/16 ) + cx*16;
+            if ( cl.partialLit[i*2]>world.getSkyLight ( x,y,z ) )
+                world.setSkyLight ( x,y,z,cl.partialLit[i*2] );
+            if ( cl.partialLit[i*2+1]>world.getBlockLight ( x,y,z ) )
+                world.setBlockLight ( x,y,z,cl.partialLit[i*2+1] );
+        }
+        break;
+    }
+}
 
-                int index = x + ( z * ymax +y ) * xmax;
-                int blocktype = mclayers[index];
+//lights the chunk columns from cx0 up to cx1, the columns either side are only read - light travels less than
+//16 blocks sideways, so a column with a converted chunk column on both sides comes out the same as it would
+//lighting the whole world at once
+void calcLighting ( myWorld &world, int cx0, int cx1 )
+{
+    myLightJob job;
+    job.world = &world;
+    job.cx0 = cx0;
+    int count = ( cx1-cx0 ) *world.chunksy;
+    job.chunks.resize ( count );
+    for ( int i=0;i<count;i++ )
+    {
+        myChunkLight &cl = job.chunks[i];
+        int cx = cx0 + i/world.chunksy;
+        int cy = i%world.chunksy;
+        myLightQueue *queues[2] = { &cl.sky, &cl.block };
+        for ( int q=0;q<2;q++ )
+        {
+            queues[q]->world = &world;
+            queues[q]->x0 = cx*16;
+            queues[q]->x1 = cx*16+16;
+            queues[q]->y0 = cy*16;
+            queues[q]->y1 = cy*16+16;
+            queues[q]->wx0 = cx0*16;
+            queues[q]->wx1 = min ( cx1*16,world.xsize );
+            queues[q]->isSky = q==0;
+            queues[q]->outbox = &cl.outbox;
+        }
+    }
 
-                if ( cubePartialLit[blocktype] )
-                {
-                    //calc skylight
-                    lightCubeSky ( mcskylight, xmax, ymax, zmax, x, y, z, index,0 );
+    int threads = getThreadCount();
+    job.stage = LIGHT_CLEAR;
+    parallelFor ( threads, count, lightChunk, &job );//the height maps all have to be done before they are seeded
+    job.stage = LIGHT_SEED;
+    while ( true )
+    {
+        parallelFor ( threads, count, lightChunk, &job );
 
-                    //calc blocklight
-                    lightCubeBlock ( mcblocklight, xmax, ymax, zmax, x, y, z, index,0 );
-                }
+        //pass on the light that crossed into other chunk columns, for the next round
+        bool crossed = false;
+        for ( int i=0;i<count;i++ )
+        {
+            std::vector<myLightUpdate> &out = job.chunks[i].outbox;
+            for ( size_t u=0;u<out.size();u++ )
+            {
+                int to = ( ( out[u].x>>4 ) - cx0 ) *world.chunksy + ( out[u].y>>4 );
+                job.chunks[to].inbox.push_back ( out[u] );
+                crossed = true;
             }
+            out.clear();
         }
+        if ( !crossed )
+            break;
+        job.stage = LIGHT_EXCHANGE;
     }
 
+    job.stage = LIGHT_PARTIAL;
+    parallelFor ( threads, count, lightChunk, &job );
+    job.stage = LIGHT_APPLY;
+    parallelFor ( threads, count, lightChunk, &job );
 }
 
 void calcLightingIndev ( DFHack::color_ostream & out, uint8_t *mcdata,uint8_t *mcskylight,uint8_t *mcblocklight, int mcxsquares, int mcysquares, int mczsquares )
@@ -1282,23 +3672,65 @@ void calcLightingIndev ( DFHack::color_ostream & out, uint8_t *mcdata,uint8_t *m
 
 
 
-void replacespaces ( char* str )
+uint32_t getMapIndex ( uint32_t x,uint32_t y,uint32_t z )
 {
-    while ( *str!='\0' )
-    {
-        if ( *str==' ' || ( !isalnum ( *str ) && *str!='_' && *str!='.' && *str!='-' ) )
-            *str='_';
-        *str = tolower ( *str );
-        str++;
-    }
+    return ( ( z&0x1ff ) <<22 ) | ( ( x&0x7ff ) <<11 ) | ( y&0x7ff );
 }
 
-uint32_t getMapIndex ( uint32_t x,uint32_t y,uint32_t z )
+uint32_t tileRandom ( uint32_t x,uint32_t y,uint32_t z )
 {
-    return ( ( z&0x1ff ) <<22 ) | ( ( x&0x7ff ) <<11 ) | ( y&0x7ff );
+    //a 'random' number for a DF location, so the result doesn't depend on the order locations are converted in
+    uint64_t h = ( uint64_t ) seed ^ ( ( ( uint64_t ) getMapIndex ( x,y,z ) ) * 0x9E3779B97F4A7C15ULL );
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return ( uint32_t ) h;
 }
 
 
+void ctxPrint ( myConvertContext & ctx, bool error, const char *format, ... )
+{
+    char buf[1024];
+    va_list args;
+    va_start ( args, format );
+    vsnprintf ( buf, 1023, format, args );
+    va_end ( args );
+    buf[1023]='\0';
+    ctx.messages.push_back ( std::make_pair ( error, std::string ( buf ) ) );
+}
+
+void recordUnknown ( myConvertContext & ctx, TiXmlElement *section,const char* name,const char *data, int stattype )
+{
+    myUnknown u;
+    u.section = section;
+    u.name = name;
+    u.hasdata = ( data!=NULL );
+    if ( data!=NULL )
+        u.data = data;
+    u.stattype = stattype;
+    ctx.unknowns.push_back ( u );
+}
+
+uint8_t* findMat ( myConvertContext & ctx, const char* name, bool &local )
+{
+    //dfMats is only read while blocks are being converted, materials created by this block are kept aside
+    std::map<std::string,uint8_t*>::iterator it = dfMats.find ( name );
+    if ( it!=dfMats.end() )
+        return it->second;
+    if ( !ctx.newMats.empty() )
+    {
+        it = ctx.newMats.find ( name );
+        if ( it!=ctx.newMats.end() )
+        {
+            local = true;
+            return it->second;
+        }
+    }
+    return NULL;
+}
+
 void addUnknown ( TiXmlElement *uio, TiXmlElement *section,const char* name,const char *data, int stattype )
 {
 
@@ -1328,8 +3760,8 @@ void addUnknown ( TiXmlElement *uio, TiXmlElement *section,const char* name,cons
 
 }
 
-uint8_t* getMaterial ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int y, int z,const  char* basicmaterial, int variant=0,
-                       const char* fullname = NULL, const char* specificmaterial = NULL, const char* constmat = NULL, bool addstats = true )
+void resolveMaterial ( myConvertContext & ctx, myMatResult &res, const  char* basicmaterial, int variant,
+                       const char* fullname, const char* specificmaterial, const char* constmat )
 {
 
     //check order
@@ -1419,7 +3851,8 @@ uint8_t* getMaterial ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int
     for ( int r=0;r<NUM_OBJECT_CHECKS;r++ )
         replacespaces ( loc[r] );
 
-    uint8_t *material = NULL;
+    res.material = NULL;
+    res.local = false;
 
     //find the best description we have for the location
     int bpos=NUM_OBJECT_CHECKS-1;
@@ -1429,75 +3862,387 @@ uint8_t* getMaterial ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int
         bpos--;
         best = loc[bpos];
     }
+    res.best = best;
+    res.basic = loc[0];
 
     //find the most descriptive object that matches the current location
-    if ( dfMats.find ( best ) ==dfMats.end() )
+    uint8_t *perfect = findMat ( ctx, best, res.local );
+    if ( perfect!=NULL )
+    {
+        // perfect match found (this is probably rare) use this object
+        res.material = perfect;
+        res.outcome = PERFECT;
+        return;
+    }
+
+    //no perfect match - find a good match and add perfect to list of unimplemented objects
+    for ( int l= ( NUM_OBJECT_CHECKS-1 );l>-1;l-- )
     {
-        //no perfect match - find a good match and add perfect to list of unimplemented objects
-        char* use=NULL;
-        for ( int l= ( NUM_OBJECT_CHECKS-1 );l>-1&&use==NULL;l-- )
+        if ( loc[l][0]!='\0' && ( res.material = findMat ( ctx, loc[l], res.local ) ) !=NULL )
         {
-            if ( loc[l][0]!='\0' && dfMats.find ( loc[l] ) !=dfMats.end() )
-            {
-                use=loc[l];
-                material=dfMats[use];
-            }
+            res.outcome = IMPERFECT;
+            return;
         }
-        if ( use!=NULL )
+    }
+
+    res.outcome = UNKNOWN;
+}
+
+uint8_t* applyMaterial ( myConvertContext & ctx,int x, int y, int z,const myMatResult *res, bool addstats )
+{
+    //counts the outcome of a material lookup and creates missing materials
+    uint8_t *material = res->material;
+    if ( res->outcome==PERFECT )
+    {
+        //DFConsole->print("location %d,%d,%d is %s\t\n",x,y,z,best);
+        if ( addstats )
+            ctx.stats[MATERIALS][PERFECT]++;
+    }
+    else if ( res->outcome==IMPERFECT )
+    {
+        if ( addstats )
         {
-            if ( addstats )
-            {
-                if ( strstr ( use,"." ) ==NULL && strstr ( use,"air" ) !=use && strstr ( use,"logs" ) !=use && strstr ( use,"grass" ) !=use && strstr ( use,"unknown" ) !=use )
-                {
-                    //DFConsole->print("location %d,%d,%d is %s\tusing %s\n",x,y,z,best,use);
-                }
-                stats[MATERIALS][IMPERFECT]++;
-                addUnknown ( uio, xmlmaterials, best, NULL, MATERIALS );
-            }
-            else
-            {
-                addUnknown ( uio, xmlmaterials, best, NULL, -1 );
-            }
+            ctx.stats[MATERIALS][IMPERFECT]++;
+            recordUnknown ( ctx, xmlmaterials, res->best.c_str(), NULL, MATERIALS );
         }
         else
         {
-            //not even a basic object found - create a basic object for hack/df2mc.xml
-            if ( addstats )
-            {
-                out.print ( "location %d,%d,%d is %s\tNOT FOUND!\tcreating %s as air\n",x,y,z,best,loc[0] );
-                stats[MATERIALS][UNKNOWN]++;
+            recordUnknown ( ctx, xmlmaterials, res->best.c_str(), NULL, -1 );
+        }
+    }
+    else
+    {
+        //not even a basic object found - create a basic object for hack/df2mc.xml
+        myMissingMat missing;
+        missing.basic = res->basic;
+        missing.perfect = res->best==res->basic;
+        missing.addstats = addstats;
+        missing.message = -1;
+        if ( addstats )
+        {
+            missing.message = ( int ) ctx.messages.size();
+            ctxPrint ( ctx, false, "location %d,%d,%d is %s\tNOT FOUND!\tcreating %s as air\n",x,y,z,res->best.c_str(),res->basic.c_str() );
+            ctx.stats[MATERIALS][UNKNOWN]++;
+
+            //added to dfMats and hack/df2mc.xml when this block is merged
+            material = makeAirArrayInt();
+            ctx.newMats[res->basic] = material;
+        }
+
+        missing.unknown = ( int ) ctx.unknowns.size();
+        recordUnknown ( ctx, xmlmaterials, res->best.c_str(), NULL, addstats?MATERIALS:-1 );
+        ctx.missing.push_back ( missing );
+    }
+
+    return material;
+}
+
+uint8_t* getMaterial ( myConvertContext & ctx,int x, int y, int z,const  char* basicmaterial, int variant=0,
+                       const char* fullname = NULL, const char* specificmaterial = NULL, const char* constmat = NULL, bool addstats = true )
+{
+    if ( specificmaterial!=NULL && specificmaterial[0]=='\0' )
+        specificmaterial = NULL;
 
-                TiXmlElement * ss = new TiXmlElement ( loc[0] );
-                ss->SetAttribute ( "mat",makeAirArray() );
-                ss->SetAttribute ( "data","" );
-                xmlmaterials->LinkEndChild ( ss );
+    myMatResult found;
+    const myMatResult *res = NULL;
+    uint32_t hash = 0;
+    if ( ctx.matCache!=NULL )
+    {
+        hash = myMaterialCache::hashKey ( basicmaterial,variant,fullname,specificmaterial,constmat );
+        res = ctx.matCache->find ( hash,basicmaterial,variant,fullname,specificmaterial,constmat );
+    }
+    if ( res==NULL )
+    {
+        resolveMaterial ( ctx, found, basicmaterial, variant, fullname, specificmaterial, constmat );
+        //materials only this block knows about and missing ones can change, so they aren't kept
+        if ( ctx.matCache!=NULL && found.outcome!=UNKNOWN && !found.local )
+            ctx.matCache->insert ( hash,basicmaterial,variant,fullname,specificmaterial,constmat,found );
+        res = &found;
+    }
+
+    return applyMaterial ( ctx,x,y,z,res,addstats );
+}
+
+//stamping and blending of objects, instantiated for every squaresize so the loops are unrolled
+//and the right ones are picked once when the export starts
+typedef void ( *myStampFunc ) ( mySection *sec, const uint8_t *object, int idx, bool overwrite );
+typedef void ( *myBlendFunc ) ( uint8_t *object, const uint8_t *shape, const uint8_t *mat );
+
+uint8_t safeSandTable[256];     //sandTable if safesand is on, otherwise empty
+myStampFunc stampFunc = NULL;
+myBlendFunc blendFunc = NULL;
+
+#define SECTION_ROW     16
+#define SECTION_PLANE   256
+
+inline void stampVoxel ( mySection *sec, int idx, uint8_t mat, uint8_t data, bool overwrite )
+{
+    if ( overwrite || sec->block ( idx ) ==0 )
+    {
+        if ( safeSandTable[mat] && nonSupportTable[sec->block ( idx-SECTION_PLANE )] )
+        {
+            //this is sand (or other gravity obaying block) on the bottom level with air (or other nonsupport block) below it and safe sand is on, replace the sand
+            mat=safesand;
+        }
+        sec->set ( idx,mat,data>>4 );//objects keep the data in the upper nibble
+    }
+}
 
-                material = makeAirArrayInt();
-                dfMats[loc[0]] = material;
+template <int S>
+void stampObject ( mySection *sec, const uint8_t *object, int idx, bool overwrite )
+{
+    //idx is the top corner of the object, object x goes down the MC rows, object y along them and object z down the planes
+    const int size = S*S*S;
+    int pos = 0;
+    for ( int oz=0;oz<S;oz++ )
+    {
+        for ( int oy=0;oy<S;oy++ )
+        {
+            for ( int ox=0;ox<S;ox++ )
+            {
+                stampVoxel ( sec,idx - oz*SECTION_PLANE + oy - ox*SECTION_ROW,object[pos],object[pos+size],overwrite );
+                pos++;
             }
+        }
+    }
+}
+
+template <>
+void stampObject<1> ( mySection *sec, const uint8_t *object, int idx, bool overwrite )
+{
+    //one MC block per DF square
+    stampVoxel ( sec,idx,object[0],object[1],overwrite );
+}
+
+//the material plane of an object: where the shape is 255 the material shows through
+typedef void ( *myBlendPlaneFunc ) ( uint8_t *object, const uint8_t *shape, const uint8_t *mat, int size );
+myBlendPlaneFunc blendPlaneFunc = NULL;
+
+void blendPlane ( uint8_t *object, const uint8_t *shape, const uint8_t *mat, int size )
+{
+    for ( int i=0;i<size;i++ )
+    {
+        object[i] = ( shape[i]==255 ) ? mat[i] : shape[i];
+    }
+}
+
+#ifdef USE_SSE2
+TARGET_SSE2 void blendPlaneSSE2 ( uint8_t *object, const uint8_t *shape, const uint8_t *mat, int size )
+{
+    const __m128i full = _mm_set1_epi8 ( ( char ) 0xff );
+    int i=0;
+    for ( ;i+16<=size;i+=16 )
+    {
+        __m128i sh = _mm_loadu_si128 ( ( const __m128i* ) ( shape+i ) );
+        __m128i ma = _mm_loadu_si128 ( ( const __m128i* ) ( mat+i ) );
+        __m128i use = _mm_cmpeq_epi8 ( sh,full );
+        _mm_storeu_si128 ( ( __m128i* ) ( object+i ),_mm_or_si128 ( _mm_and_si128 ( use,ma ),_mm_andnot_si128 ( use,sh ) ) );
+    }
+    blendPlane ( object+i,shape+i,mat+i,size-i );
+}
+#endif
+
+#ifdef USE_AVX2
+TARGET_AVX2 void blendPlaneAVX2 ( uint8_t *object, const uint8_t *shape, const uint8_t *mat, int size )
+{
+    const __m256i full = _mm256_set1_epi8 ( ( char ) 0xff );
+    int i=0;
+    for ( ;i+32<=size;i+=32 )
+    {
+        __m256i sh = _mm256_loadu_si256 ( ( const __m256i* ) ( shape+i ) );
+        __m256i ma = _mm256_loadu_si256 ( ( const __m256i* ) ( mat+i ) );
+        __m256i use = _mm256_cmpeq_epi8 ( sh,full );
+        _mm256_storeu_si256 ( ( __m256i* ) ( object+i ),_mm256_blendv_epi8 ( sh,ma,use ) );
+    }
+    blendPlaneSSE2 ( object+i,shape+i,mat+i,size-i );
+}
+#endif
+
+//0 none, 1 SSE2, 2 AVX2
+int getSimdLevel()
+{
+    int level = 0;
+#if defined(USE_SSE2) && defined(_MSC_VER)
+    int info[4];
+    __cpuid ( info,1 );
+    if ( info[3] & ( 1<<26 ) )
+        level = 1;
+#ifdef USE_AVX2
+    //AVX2 needs the OS to save the YMM registers too
+    if ( level && ( info[2] & ( 1<<27 ) ) && ( _xgetbv ( 0 ) & 6 ) ==6 )
+    {
+        __cpuidex ( info,7,0 );
+        if ( info[1] & ( 1<<5 ) )
+            level = 2;
+    }
+#endif
+#elif defined(SSE2_BASELINE)
+    level = 1;
+#elif defined(USE_SSE2)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports ( "sse2" ) )
+        level = 1;
+    if ( level && __builtin_cpu_supports ( "avx2" ) )
+        level = 2;
+#endif
+    return level;
+}
+
+template <int S>
+void blendKernel ( uint8_t *object, const uint8_t *shape, const uint8_t *mat )
+{
+    const int size = S*S*S;
+    blendPlaneFunc ( object,shape,mat,size );
+    memcpy ( object+size,shape+size,size );
+}
+
+const char* selectKernels()
+{
+    static const myStampFunc stampers[10] = { stampObject<1>,stampObject<2>,stampObject<3>,stampObject<4>,stampObject<5>,
+                                              stampObject<6>,stampObject<7>,stampObject<8>,stampObject<9>,stampObject<10>
+                                            };
+    static const myBlendFunc blenders[10] = { blendKernel<1>,blendKernel<2>,blendKernel<3>,blendKernel<4>,blendKernel<5>,
+                                              blendKernel<6>,blendKernel<7>,blendKernel<8>,blendKernel<9>,blendKernel<10>
+                                            };
+    stampFunc = stampers[squaresize-1];
+    blendFunc = blenders[squaresize-1];
+    for ( int i=0;i<256;i++ )
+        safeSandTable[i] = safesand ? sandTable[i] : 0;
+
+    int simd = getSimdLevel();
+#ifdef USE_AVX2
+    if ( simd>=2 )
+    {
+        blendPlaneFunc = blendPlaneAVX2;
+        packSectionFunc = packSectionAVX2;
+        return "AVX2";
+    }
+#endif
+#ifdef USE_SSE2
+    if ( simd>=1 )
+    {
+        blendPlaneFunc = blendPlaneSSE2;
+        packSectionFunc = packSectionSSE2;
+        return "SSE2";
+    }
+#endif
+    blendPlaneFunc = blendPlane;
+    packSectionFunc = packSection;
+    return "no SIMD";
+}
 
-            addUnknown ( uio, xmlmaterials, best, NULL, addstats?MATERIALS:-1 );
+//'df2minecraft benchmark' - times each section packing kernel this CPU can run on random sections
+//and checks they all give the same chunk as the plain C++ one
+void benchmarkPacking ( color_ostream &out )
+{
+    const int sections = 64;
+    const int sectionBytes = SECTION_BLOCKS + SECTION_NIBBLES*3;
+    std::vector<uint8_t> in ( sections*sectionBytes );
+    uint32_t seed = 12345;
+    for ( size_t i=0;i<in.size();i++ )
+    {
+        seed = seed*1103515245 + 12345;
+        in[i] = seed>>24;
+    }
+
+    const int chunkBytes = 16*16*CHUNK_HEIGHT*5/2;
+    std::vector<uint8_t> expect ( chunkBytes );
+    std::vector<uint8_t> got ( chunkBytes );
+
+    const char *names[3] = { "scalar","SSE2","AVX2" };
+    myPackSectionFunc funcs[3] = { packSection,NULL,NULL };
+#ifdef USE_SSE2
+    funcs[1] = packSectionSSE2;
+#endif
+#ifdef USE_AVX2
+    funcs[2] = packSectionAVX2;
+#endif
+    int simd = getSimdLevel();
+    for ( int k=0;k<3;k++ )
+    {
+        if ( funcs[k]==NULL || k>simd )
+        {
+            out.print ( "%-8s not available\n",names[k] );
+            continue;
+        }
+        std::vector<uint8_t> &chunk = k==0 ? expect : got;
+        uint8_t *blocks = &chunk[0];
+        uint8_t *data = blocks + 16*16*CHUNK_HEIGHT;
+        uint8_t *sky = data + 16*16*CHUNK_HEIGHT/2;
+        uint8_t *light = sky + 16*16*CHUNK_HEIGHT/2;
+
+        //run for at least half a second so the millisecond clock is good enough
+        int64_t packed = 0;
+        int64_t start = getMillis();
+        int64_t elapsed = 0;
+        do
+        {
+            for ( int i=0;i<sections;i++ )
+            {
+                const uint8_t *sec = &in[i*sectionBytes];
+                funcs[k] ( sec,sec+SECTION_BLOCKS,sec+SECTION_BLOCKS+SECTION_NIBBLES,sec+SECTION_BLOCKS+SECTION_NIBBLES*2,
+                           i% ( CHUNK_HEIGHT/16 ),blocks,data,sky,light );
+            }
+            packed += sections;
+            elapsed = getMillis()-start;
         }
+        while ( elapsed<500 );
 
+        double mb = ( double ) packed*sectionBytes/ ( 1024.0*1024.0 );
+        out.print ( "%-8s %8.1f MB/s %8.2f ns/block%s\n",names[k],mb*1000.0/max ( elapsed, ( int64_t ) 1 ),
+                    elapsed*1000000.0/ ( ( double ) packed*SECTION_BLOCKS ),
+                    k>0 && got!=expect ? "  MISMATCH" : "" );
     }
-    else
+}
+
+uint8_t* getAirObject ( myConvertContext & ctx )
+{
+    //used for anything that isn't defined
+    if ( ctx.objCache==NULL )
+        return makeAirArrayInt();
+    if ( ctx.objCache->airObject==NULL )
     {
-        // perfect match found (this is probably rare) use this object
-        //DFConsole->print("location %d,%d,%d is %s\t\n",x,y,z,best);
-        material=dfMats[best];
-        if ( addstats )
-            stats[MATERIALS][PERFECT]++;
+        int size = squaresize*squaresize*squaresize;
+        ctx.objCache->airObject = ctx.objCache->allocate ( size*2 );
+        memset ( ctx.objCache->airObject,0,size*2 );
+    }
+    return ctx.objCache->airObject;
+}
+
+uint8_t* blendObject ( myConvertContext & ctx, const uint8_t *shape, const uint8_t *mat )
+{
+    //make the material in the shape of the object, 255 in the shape is where the material shows
+    uint8_t *object = NULL;
+    if ( ctx.objCache!=NULL )
+    {
+        object = ctx.objCache->find ( shape,mat );
+        if ( object!=NULL )
+            return object;
     }
 
-    return material;
+    int size = squaresize*squaresize*squaresize;
+    if ( ctx.objCache!=NULL )
+        object = ctx.objCache->allocate ( size*2 );
+    else
+        object = new uint8_t[size*2];
+    blendFunc ( object,shape,mat );
+
+    if ( ctx.objCache!=NULL )
+        ctx.objCache->insert ( shape,mat,object );
+    return object;
 }
 
-uint8_t* getTerrain ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int y, int z,const char* classname,const  char* basicmaterial, int variant=0,
-                      const char* fullname = NULL,const char* specificmaterial = NULL, const char* constmat = NULL,bool addstats=NULL )  //todo, change addstats to an int and see what breaks - missing constmat
+uint8_t* getTerrain ( myConvertContext & ctx,int x, int y, int z,const char* classname,const  char* basicmaterial, int variant=0,
+                      const char* fullname = NULL,const char* specificmaterial = NULL, const char* constmat = NULL,bool addstats=NULL,
+                      const myMatResult *resolved = NULL )  //todo, change addstats to an int and see what breaks - missing constmat
 {
 
     //first get the material
-    uint8_t* mat = getMaterial ( out, uio,x,y,z,basicmaterial, variant,fullname,specificmaterial, constmat, addstats );
+    uint8_t* mat;
+    if ( resolved!=NULL )
+        mat = applyMaterial ( ctx,x,y,z,resolved,addstats );
+    else
+        mat = getMaterial ( ctx,x,y,z,basicmaterial, variant,fullname,specificmaterial, constmat, addstats );
 
     //now get the terrian
     char name[256];
@@ -1505,13 +4250,12 @@ uint8_t* getTerrain ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int
     name[255]='\0';
     replacespaces ( name );
     std::map<std::string,uint8_t*>::iterator it = terrain.find ( name );
-    int size = squaresize*squaresize*squaresize;
     if ( it==terrain.end() )
     {
         if ( addstats )
         {
-            addUnknown ( uio, xmlterrain, classname, NULL, TERRAIN );
-            return makeAirArrayInt();
+            recordUnknown ( ctx, xmlterrain, classname, NULL, TERRAIN );
+            return getAirObject ( ctx );
         }
         else
         {
@@ -1520,29 +4264,15 @@ uint8_t* getTerrain ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int
     }
     else
     {
-        stats[TERRAIN][PERFECT]++;
+        ctx.stats[TERRAIN][PERFECT]++;
     }
 
     //now make the material in the shape of the terain
-    uint8_t *terrain = new uint8_t[size*2];
-    for ( int i=0;i<size;i++ )
-    {
-        if ( it->second[i]==255 )
-        {
-            terrain[i]=mat[i];
-        }
-        else
-        {
-            terrain[i]=it->second[i];
-        }
-        terrain[size+i]=it->second[size+i];
-    }
-
-    return terrain;
+    return blendObject ( ctx,it->second,mat );
 }
 
 
-uint8_t* getFlow ( TiXmlElement *uio,int x, int y, int z,const char* classname,const  char* basicmaterial, int variant=0,
+uint8_t* getFlow ( myConvertContext & ctx,int x, int y, int z,const char* classname,const  char* basicmaterial, int variant=0,
                    const char* fullname = NULL,const char* specificmaterial = NULL,bool addstats=true )
 {
 
@@ -1558,35 +4288,30 @@ uint8_t* getFlow ( TiXmlElement *uio,int x, int y, int z,const char* classname,c
     int size = squaresize*squaresize*squaresize;
     if ( it==flows.end() )
     {
-        addUnknown ( uio, xmlflows, classname, NULL, FLOWS );
-        return makeAirArrayInt();
+        recordUnknown ( ctx, xmlflows, classname, NULL, FLOWS );
+        return getAirObject ( ctx );
     }
     else
     {
-        stats[FLOWS][PERFECT]++;
+        ctx.stats[FLOWS][PERFECT]++;
     }
 
     //return terrain;
     return it->second;
 }
 
-uint8_t* getPlant ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int y, int z,const char* classname,const  char* basicmaterial, int variant=0,
-                    const char* fullname = NULL,const char* specificmaterial = NULL,bool addstats=true )
+void findPlantShape ( myShapeResult &res,const char* classname )
 {
-
-    //first get the material
-    uint8_t* mat = getMaterial ( out, uio,x,y,z,basicmaterial, variant,fullname,specificmaterial );
-
-    //now get the terrian
     char name[256];
     strncpy ( name,classname,255 );
     name[255]='\0';
     replacespaces ( name );
     std::map<std::string,uint8_t*>::iterator it = plants.find ( name );
-    int size = squaresize*squaresize*squaresize;
+    res.outcome = PERFECT;
     if ( it==plants.end() )
     {
         //didn't find specific plant type, try generic
+        res.outcome = IMPERFECT;
         char *pos = strchr ( name,'.' );
         if ( pos!=NULL )
         {
@@ -1594,51 +4319,49 @@ uint8_t* getPlant ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int y,
             it = plants.find ( name );
         }
         if ( it==plants.end() )
-        {
-            addUnknown ( uio, xmlplants, classname, NULL, PLANTS );
-            return makeAirArrayInt();
-        }
-        else
-        {
-            stats[PLANTS][IMPERFECT]++;
-        }
+            res.outcome = UNKNOWN;
     }
-    else
+    res.shape = ( it!=plants.end() ) ? it->second : NULL;
+}
+
+uint8_t* getPlant ( myConvertContext & ctx,int x, int y, int z,const char* classname,const  char* basicmaterial, int variant=0,
+                    const char* fullname = NULL,const char* specificmaterial = NULL,bool addstats=true,
+                    const myShapeResult *resolved = NULL )
+{
+
+    //first get the material
+    uint8_t* mat = getMaterial ( ctx,x,y,z,basicmaterial, variant,fullname,specificmaterial );
+
+    //now get the plant
+    myShapeResult found;
+    if ( resolved==NULL )
     {
-        stats[PLANTS][PERFECT]++;
+        findPlantShape ( found,classname );
+        resolved = &found;
     }
-
-    //now make the material in the shape of the terain
-    uint8_t *plant = new uint8_t[size*2];
-    for ( int i=0;i<size;i++ )
+    if ( resolved->outcome==UNKNOWN )
     {
-        if ( it->second[i]==255 )
-        {
-            plant[i]=mat[i];
-        }
-        else
-        {
-            plant[i]=it->second[i];
-        }
-        plant[size+i]=it->second[size+i];
+        recordUnknown ( ctx, xmlplants, classname, NULL, PLANTS );
+        return getAirObject ( ctx );
     }
+    ctx.stats[PLANTS][resolved->outcome]++;
 
-    return plant;
+    //now make the material in the shape of the plant
+    return blendObject ( ctx,resolved->shape,mat );
 }
 
-uint8_t* getBuilding ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int y, int z,const char* classname, int direction, const  char* basicmaterial,
+uint8_t* getBuilding ( myConvertContext & ctx,int x, int y, int z,const char* classname, int direction, const  char* basicmaterial,
                        const char* fullname = NULL,const char* specificmaterial = NULL,bool addstats=true )
 {
 
     //first get the material
-    uint8_t* mat = getMaterial ( out, uio,x,y,z,basicmaterial, 0,fullname,specificmaterial,NULL,addstats );
+    uint8_t* mat = getMaterial ( ctx,x,y,z,basicmaterial, 0,fullname,specificmaterial,NULL,addstats );
 
     //now get the building
     char name[256];
     snprintf ( name,255,"%s.%d",classname,direction );
     name[255]='\0';
     replacespaces ( name );
-    int size = squaresize*squaresize*squaresize;
     std::map<std::string,uint8_t*>::iterator it = buildings.find ( name );
     if ( it==buildings.end() )
     {
@@ -1667,8 +4390,8 @@ uint8_t* getBuilding ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int
         {
             if ( addstats )
             {
-                addUnknown ( uio, xmlbuildings, classname, NULL, BUILDINGS );
-                return makeAirArrayInt();
+                recordUnknown ( ctx, xmlbuildings, classname, NULL, BUILDINGS );
+                return getAirObject ( ctx );
             }
             else
             {
@@ -1677,273 +4400,141 @@ uint8_t* getBuilding ( DFHack::color_ostream & out, TiXmlElement *uio,int x, int
         }
         else
         {
-            stats[BUILDINGS][IMPERFECT]++;
+            ctx.stats[BUILDINGS][IMPERFECT]++;
         }
     }
     else if ( addstats )
     {
-        stats[BUILDINGS][PERFECT]++;
-    }
-
-    //now make the material in the shape of the terain
-    uint8_t *building = new uint8_t[size*2];
-    for ( int i=0;i<size;i++ )
-    {
-        if ( it->second[i]==255 )
-        {
-            building[i]=mat[i];
-        }
-        else
-        {
-            building[i]=it->second[i];
-        }
-        building[size+i]=it->second[size+i];
+        ctx.stats[BUILDINGS][PERFECT]++;
     }
 
-    return building;
+    //now make the material in the shape of the building
+    return blendObject ( ctx,it->second,mat );
 }
 
 
-void addObject ( uint8_t* mclayers, uint8_t* mcdata, uint8_t *object, int dfx, int dfy, int dfz, int xoffset, int yoffset, int zoffset, int mcxsquares, int mcysquares,bool overwrite=false )
+void addObject ( myWorld &world, uint8_t *object, int dfx, int dfy, int dfz, int xoffset, int yoffset, int zoffset, bool overwrite=false )
 {
 
-    //now copy object in to mclayer array
+    //now copy object in to the world
 
     int mcx = dfx * squaresize - ( xoffset*SQUARESPERBLOCK*squaresize );
     int mcy = dfy * squaresize - ( yoffset*SQUARESPERBLOCK*squaresize );
     //int mcz = dfz * squaresize - (zoffset*squaresize);
     int mcz = ( zoffset*squaresize ) + 1;
-    int pos = 0;
-    int pos2 = squaresize*squaresize*squaresize;
 
-    for ( int oz=0;oz<squaresize;oz++ )
+    //also MC's X and Z seem rotated to the assumed DF X and Y - correcting so that sun in MC rises in DF East
+    //this is the corner of the object at ox=0, oy=0 and oz=0 (its top)
+    int x = mcy;
+    int y = ( world.ysize-1 )- mcx;
+    int z = mcz+squaresize-1;
+    const int S = squaresize;
+
+    //note down the blocks lighting has to start from, so it doesn't have to look through the whole world for them
+    for ( int i=0;i<S*S*S;i++ )
     {
-        for ( int oy=0;oy<squaresize;oy++ )
+        uint8_t mat = object[i];
+        if ( cubeBlockOpacity[mat]<0 || cubePartialLit[mat] )
         {
-            for ( int ox=0;ox<squaresize;ox++ )
-            {
-
-                //Index = x + (y * Depth + z) * Width //where y is up down
-                //int x = (mcx+ox);
-                //int y = (mcy+oy);
-                //int z = (mcz+2-oz);
-                //also MC's X and Z seem rotated to the assumed DF X and Y - correcting so that sun in MC rises in DF East
-                int x = ( mcy+oy );
-                int y = ( mcxsquares-1 )- ( mcx+ox );
-                int z = ( mcz+2-oz );
-                int idx = x + ( z * mcysquares +y ) * mcxsquares;
-                if ( overwrite || mclayers[idx]==0 )
-                {
-                    if ( safesand && sandhash.find ( object[pos] ) !=sandhash.end() )
-                    {
-                        hash_set<int>::iterator it = supporthash.find ( mclayers[x + ( ( z-1 ) * mcysquares +y ) * mcxsquares] );
-                        if ( it != supporthash.end() )
-                        {
-                            //this is sand (or other gravity obaying block) on the bottom level with air (or other nonsupport block) below it and safe sand is on, replace the sand
-                            mclayers[idx]=safesand;
-                            mcdata[idx]=object[pos2];
-                        }
-                        else
-                        {
-                            mclayers[idx]=object[pos];
-                            mcdata[idx]=object[pos2];
-                        }
-                    }
-                    else
-                    {
-                        mclayers[idx]=object[pos];
-                        mcdata[idx]=object[pos2];
-                    }
-                }
-                pos++;
-                pos2++;
-            }
+            int wx = x + ( i/S ) %S;
+            int wy = y - i%S;
+            int wz = z - i/ ( S*S );
+            if ( world.inside ( wx,wy,wz ) )
+                world.lightBlocks[ ( wx>>4 ) *world.chunksy + ( wy>>4 )].push_back ( ( wz<<8 ) | ( ( wy&15 ) <<4 ) | ( wx&15 ) );
         }
     }
-}
-
-
-void getObjDir ( DFHack::color_ostream & out, DFHack::mapblock40d *Bl,TiXmlElement *uio,char *dir,int x,int y,int z,int bx, int by,const char* classname,
-                 const char* mat, int varient,const char* full,const char* specmat,const char* consmat,const bool building = false )
-{
-    //this will find and place in the string dir the letters of the high side of a ramp
-
-    DFHack::mapblock40d *Block;
-    DFHack::mapblock40d *BlockLast = Bl;
-    DFHack::mapblock40d B;
-    //TileClass tc;
-    df::tiletype_shape ts;
-
-    int blockx,blocky,offsetx,offsety;
-    int lastblockx = bx;
-    int lastblocky = by;
-
-    // Ramps are named with numbers to indicate which side have 'walls' - the high sides
-    // other sides are assumed to be low, but may also have ramps (does this need to be handled?)
-    // assuming ramp is at position 5 (which will never be shown as high) walls are numbered like this:
-    // 1 2 3
-    // 4 5 6
-    // 7 8 9
-    //
-    // numbers will be listed in number order, a wall to the south, southwest and west is 478 not 874 or other possibilities
-    //
-    // we first try to find a defination of a ramp using all directions (numbers)
-    // if we don't find a match, we then then limit to directly north, south , east, and west (2,4,6,8)
-    // so if a wall to the south, southwest and west is not found as 478, we will check if 48 exists and if not, use no numbers
 
-    //ok first we will try to find an exact match for the ramp
-    uint8_t* obj = NULL;
-    int step = 1;
-    int start = 1;
-    //this DO tries all numbers first, and only the even ones in the second pass
-    do
+    //the object covers x to x+S-1, y-S+1 to y and z-S+1 to z, and safe sand looks at the block under it
+    if ( ( x>>4 ) == ( ( x+S-1 ) >>4 ) && ( y>>4 ) == ( ( y-S+1 ) >>4 ) && ( z>>4 ) == ( ( z-S ) >>4 ) &&
+            world.inside ( x,y-S+1,z-S ) && world.inside ( x+S-1,y,z ) )
     {
-        char *pos=dir;
-
-        for ( int i=start;i<10;i+=step )
+        //all in one section, stamp straight into it
+        mySection *sec = world.get ( x,y,z );
+        if ( sec==NULL )
         {
+            //stamping air into a section that isn't there yet does nothing
+            int size = S*S*S*2;
+            int i=0;
+            while ( i<size && object[i]==0 )
+                i++;
+            if ( i==size )
+                return;
+            sec = world.getForWrite ( x,y,z );
+        }
+        stampFunc ( sec, object, sectionIndex ( x,y,z ), overwrite );
+        return;
+    }
 
-            if ( i==5 ) continue;//don't check self
-
-            int ox= ( ( i-1 ) %3 )-1;
-            int oy= ( ( i-1 ) /3 )-1;
-
-
-            blockx  =   ( x+ox ) / SQUARESPERBLOCK;
-            offsetx =   ( x+ox ) % SQUARESPERBLOCK;
-            blocky  =   ( y+oy ) / SQUARESPERBLOCK;
-            offsety =   ( y+oy ) % SQUARESPERBLOCK;
-            //see if we already have that block (we should most of the time)
-            if ( blockx == lastblockx && blocky == lastblocky )
-            {
-                Block=BlockLast;
-            }
-            else
-            {
-                if ( Maps::getBlock ( blockx,blocky,z ) )
-                {
-                    Maps::ReadBlock40d ( blockx,blocky,z, &B );
-                    Block=&B;
-                    lastblockx = blockx;
-                    lastblocky = blocky;
-                    BlockLast = Block;
-                }
-                else
-                {
-                    Block=NULL;
-                }
-            }
-            //check location for wall or fortification
-            if ( Block!=NULL )
+    //the object is split over sections, go through the world a block at a time
+    const int size = S*S*S;
+    int pos = 0;
+    for ( int oz=0;oz<S;oz++ )
+    {
+        for ( int oy=0;oy<S;oy++ )
+        {
+            for ( int ox=0;ox<S;ox++ )
             {
-                ts = tileShape(Block->tiletypes[offsetx][offsety]);
-                if ( ts == tiletype_shape::WALL || ts == tiletype_shape::FORTIFICATION )
+                int wx = x+oy;
+                int wy = y-ox;
+                int wz = z-oz;
+                uint8_t mat = object[pos];
+                if ( world.inside ( wx,wy,wz ) && ( overwrite || world.getBlock ( wx,wy,wz ) ==0 ) )
                 {
-                    *pos= ( '0'+i );
-                    pos++;
+                    if ( safeSandTable[mat] && nonSupportTable[world.getBlock ( wx,wy,wz-1 )] )
+                        mat = safesand;
+                    world.setBlock ( wx,wy,wz,mat,object[pos+size]>>4 );
                 }
+                pos++;
             }
-
-        }
-
-        *pos='\0';
-        //try to find a match
-        char test[128];
-
-        if ( !building )
-        {
-            snprintf ( test,127,"%s%s",classname,dir );
-            test[127]='\0';
-            obj = getTerrain ( out, uio,x,y,z,test,mat,varient,full,specmat,NULL,false );
-        }
-        else
-        {
-            int idir = atoi ( dir );
-            obj = getBuilding ( out, uio,x,y,z,classname,-idir,mat,full,specmat,false );
         }
-
-        //setup of next DO loop, if needed
-        step++;
-        start++;
-    }
-    while ( obj==NULL && start < 3 );
-
-    if ( obj==NULL )   //no match found - use 'undirected' ramp
-    {
-        dir[0]='\0';
     }
-
 }
 
-int getBuildingDir ( DFHack::color_ostream & out, map<uint32_t,myBuilding> Buildings,DFHack::mapblock40d *Bl,TiXmlElement *uio,int x,int y,int z,int bx, int by,
-                     const char* thisBuilding,const char*mat, const char* full,const char* specmat,const char* buildingToFace )
+
+int getBuildingDir ( const mySnapshot & snap,int x,int y,int z,uint8_t wallmask,
+                     const char* thisBuilding,const char* buildingToFace )
 {
+    //faces the neighbouring buildings of type buildingToFace if there is an object for that,
+    //otherwise returns the (negative) direction for the surrounding walls
+    char name[256];
+    strncpy ( name,thisBuilding,255 );
+    name[255]='\0';
+    replacespaces ( name );
 
-    //similar routine to above (getRampDir), but no need to look in different map blocks
-    uint8_t* obj = NULL;
-    int step = 1;
-    int start = 1;
-    if ( strcmp ( thisBuilding,"chair" ) ==0 )
+    std::map<std::string,myBuildingDirs>::const_iterator it = buildingDirs.find ( name );
+    if ( it==buildingDirs.end() )
     {
-        start = 1;
+        char* pos = strchr ( name,'.' );
+        if ( pos!=NULL )
+        {
+            *pos='\0';
+            it = buildingDirs.find ( name );
+        }
+        if ( it==buildingDirs.end() )
+            return 0;//no directions defined for this building
     }
-    char dir[16];
-    //this DO tries all numbers first, and only the even ones in the second pass
+    const myBuildingDirs &table = it->second;
+
     if ( buildingToFace != NULL && buildingToFace[0]!='\0' )
     {
-        do
+        int facemask = 0;
+        for ( int j=0;j<8;j++ )
         {
-            char *pos = dir;
-
-            for ( int i=start;i<10;i+=step )
-            {
-
-                if ( i==5 ) continue;//don't check self
-
-                int ox= ( ( i-1 ) %3 )-1;
-                int oy= ( ( i-1 ) /3 )-1;
-
-                uint32_t index = getMapIndex ( x+ox,y+oy,z );
-                map<uint32_t,myBuilding>::iterator it;
-                it = Buildings.find ( index );
-                if ( it!=Buildings.end() )
-                {
-                    myBuilding mb = it->second;
-
-                    if ( stricmp ( mb.type,buildingToFace ) ==0 )
-                    {
-                        *pos= ( '0'+i );
-                        pos++;
-                    }
-                }
-            }
-            *pos='\0';
+            int i = j + ( j<4 ? 1 : 2 );
+            int ox= ( ( i-1 ) %3 )-1;
+            int oy= ( ( i-1 ) /3 )-1;
 
-            if ( dir[0]!='\0' )
+            map<uint32_t,myBuilding>::const_iterator bit = snap.buildings.find ( getMapIndex ( x+ox,y+oy,z ) );
+            if ( bit!=snap.buildings.end() && stricmp ( bit->second.type,buildingToFace ) ==0 )
             {
-                int idir;
-                idir = atoi ( dir );
-                obj = getBuilding ( out, uio,x,y,z,thisBuilding,idir,mat,full,specmat,false );
+                facemask |= 1<<j;
             }
-
-            //setup of next DO loop, if needed
-            step++;
-            start++;
         }
-        while ( obj==NULL && start < 3 );
+        if ( table.face[facemask]!=0 )
+            return table.face[facemask];
     }
 
-    if ( obj==NULL )   //no match found - now check for walls
-    {
-        dir[0]='\0';
-        getObjDir ( out, Bl,uio,dir,x,y,z,bx,by,thisBuilding,mat,0,full,specmat,NULL,true );
-
-        return - ( atoi ( dir ) );
-    }
-    else
-    {
-        return atoi ( dir );
-    }
+    return -table.wall[wallmask];
 }
 
 int findLevels ( int xmin,int xmax,int ymin,int ymax,int zmax,uint32_t typeToFind )
@@ -1992,21 +4583,21 @@ int findLevels ( int xmin,int xmax,int ymin,int ymax,int zmax,uint32_t typeToFin
 }
 
 // FIXME: den of evil. nuke. nuke. nuke. nuke. nuke. BZZT@!
-void getConsMats ( DFHack::color_ostream & out, std::string & mat, std::string & consmat, int type, int idx, int form, char* tempstr, int x, int y, int z )
+void getConsMats ( myConvertContext & ctx, const mySnapshot & snap, std::string & mat, std::string & consmat, int type, int idx, int form, char* tempstr, int x, int y, int z )
 {
 
     consmat="unknown";
     if ( type == 0 )
     {
-        if ( idx != -1 && idx< world->raws.inorganics.size() )
-            consmat = world->raws.inorganics[idx]->id;
+        if ( idx != -1 && idx< snap.inorganics.size() )
+            consmat = snap.inorganics[idx];
         else consmat = "inorganic";
     }
     // FIXME: this is WRONG!
     else if ( type == 420 || type == 421 || type == 422)
     {
-        if ( idx != -1 && idx< world->raws.plants.all.size() )
-            consmat = world->raws.plants.all[idx]->id;
+        if ( idx != -1 && idx< snap.plants.size() )
+            consmat = snap.plants[idx];
         else consmat = "organic";
     }
     /*
@@ -2063,10 +4654,10 @@ void getConsMats ( DFHack::color_ostream & out, std::string & mat, std::string &
     }
     else if ( type ==  39 )
     {
-        if ( idx != -1 && idx<world->raws.creatures.all.size() )
-            consmat = world->raws.creatures.all[idx]->creature_id;
+        if ( idx != -1 && idx<snap.creatures.size() )
+            consmat = snap.creatures[idx];
         else consmat = "animal";
-        out.print ( "Semi-known Construction Material at %d, %d, %d: %s  -form:%d, type:%d\n",x,y,z,consmat.c_str(),form,type );
+        ctxPrint ( ctx, false, "Semi-known Construction Material at %d, %d, %d: %s  -form:%d, type:%d\n",x,y,z,consmat.c_str(),form,type );
 
         consmat = "soap";
         //idx I believe is the creature type (I had 103 for One-humped Camel Soap), but nore sure where list of creatures is, and at this point, I'm not making soaps look different
@@ -2077,7 +4668,7 @@ void getConsMats ( DFHack::color_ostream & out, std::string & mat, std::string &
         tempstr[255]='\0';
         consmat = tempstr;
         if ( type>0 )
-            out.print ( "Unknown Construction Material at %d, %d, %d: %s  -form:%d\n",x,y,z,tempstr,form );
+            ctxPrint ( ctx, false, "Unknown Construction Material at %d, %d, %d: %s  -form:%d\n",x,y,z,tempstr,form );
     }
     switch ( form )
     {
@@ -2099,27 +4690,59 @@ void getConsMats ( DFHack::color_ostream & out, std::string & mat, std::string &
 }
 
 
-void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassign,
-                      map<uint32_t,myConstruction> & Constructions, map<uint32_t,myBuilding> & Buildings, map<uint32_t,std::string> & vegs,
-                      TiXmlElement *uio, uint8_t* mclayers, uint8_t* mcdata,
-                      uint32_t dfblockx, uint32_t dfblocky, uint32_t zzz, uint32_t zcount,
-                      uint32_t xoffset, uint32_t yoffset, int mcxsquares, int mcysquares )
+int getTileVariant ( df::tiletype tiletype )
 {
+    int variant = tileVariant(tiletype);
+    switch ( tileShape(tiletype) )
+    {
+    case tiletype_shape::TREE:
+    case tiletype_shape::SAPLING:
+    case tiletype_shape::SHRUB:
+    case tiletype_shape::RAMP:
+    case tiletype_shape::STAIR_UP:
+    case tiletype_shape::STAIR_DOWN:
+    case tiletype_shape::STAIR_UPDOWN:
+        break;
+    default:
+        //FIXME: smooth is a property of tile. smooth is also a designation meant to make dwarves avtualy do the smoothing.
+        // See tiletype_special::SMOOTH
+        if ( tileName(tiletype)!=NULL && strnicmp ( tileName(tiletype),"smooth",5 ) ==0 )  //doing this as des.smooth never seems to be set.
+        {
+            variant+=10;//and if I could figure out engraved it would be 20 over base variant
+        }
+    }
+    return variant;
+}
 
-    DFHack::mapblock40d Block;
+int getPlantSlot ( df::tiletype_shape shape )
+{
+    //treetops are the last slot
+    if ( shape==tiletype_shape::SAPLING )
+        return 1;
+    if ( shape==tiletype_shape::SHRUB )
+        return 2;
+    return 0;
+}
 
-    // read data
-    Maps::ReadBlock40d ( dfblockx,dfblocky,zzz, &Block );
-    //Maps->ReadTileTypes(x,y,z, &tiletypes);
-    //Maps->ReadDesignations(x,y,z, &designations);
+void convertDFBlock ( myConvertContext & ctx, const mySnapshot & snap,
+                      myWorld &world,
+                      uint32_t dfblockx, uint32_t dfblocky, uint32_t zzz, uint32_t zcount,
+                      uint32_t xoffset, uint32_t yoffset )
+{
 
-    vector<df::block_square_event_mineralst *> veins;
-    vector<df::block_square_event_material_spatterst *> splatter;
-    Maps::SortBlockEvents ( dfblockx,dfblocky,zzz,&veins,NULL,&splatter );
+    // everything comes from the snapshot, DF itself may be running again by now
+    myBlock *B = snap.getBlock ( dfblockx,dfblocky,zzz );
+    DFHack::mapblock40d &Block = B->block;
+    const vector<vector <uint16_t> > &layerassign = snap.layerassign;
+    vector<myVein> &veins = B->veins;
+    vector<mySpatter> &splatter = B->splatter;
     char tempstr[256];
-    t_feature local, global;
-
-    Maps::ReadFeatures(dfblockx,dfblocky,zzz,&local, &global);
+    const t_feature &local = B->local;
+    const t_feature &global = B->global;
+    myBlockWindow win;
+    win.load ( snap,dfblockx,dfblocky,zzz );
+    uint8_t wallmask[16][16];
+    win.wallMasks ( wallmask );
     for ( uint32_t dfoffsetx=0;dfoffsetx<SQUARESPERBLOCK;dfoffsetx++ )
     {
         for ( uint32_t dfoffsety=0;dfoffsety<SQUARESPERBLOCK;dfoffsety++ )
@@ -2133,6 +4756,8 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
 
             std::string mat; //item material
             std::string consmat;//material of construction
+            const char *matname = "";
+            const myMatResult *resolved = NULL;
 
             int16_t temp_inorganic = -1;
             df::tiletype_material tilemat = tileMaterial(tiletype);
@@ -2164,13 +4789,13 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                         temp_inorganic = -1;
                     }
                 }
-                if ( temp_inorganic!=-1 )
+                if ( temp_inorganic>=0 && temp_inorganic< ( int ) snap.inorganics.size() )
                 {
-                    mat = world->raws.inorganics[temp_inorganic]->id;
+                    matname = snap.inorganics[temp_inorganic].c_str();
                 }
-                else
+                if ( ctx.resolved!=NULL )
                 {
-                    mat.clear();
+                    resolved = ctx.resolved->getMat ( tiletype,matname[0]!='\0' ? temp_inorganic : -1 );
                 }
             }
             else if ( tilemat == tiletype_material::SOIL || tilemat == tiletype_material::STONE )
@@ -2189,20 +4814,20 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                 for ( int v = 0; v < ( int ) veins.size();v++ )
                 {
                     // and the bit array with a one-bit mask, check if the bit is set
-                    bool set = !! ( ( ( 1 << dfoffsetx ) & veins[v]->tile_bitmask[dfoffsety] ) >> dfoffsetx );
+                    bool set = !! ( ( ( 1 << dfoffsetx ) & veins[v].tile_bitmask[dfoffsety] ) >> dfoffsetx );
                     if ( set )
                     {
                         // store matgloss
-                        temp_inorganic = veins[v]->inorganic_mat;
+                        temp_inorganic = veins[v].inorganic_mat;
                     }
                 }
-                if ( temp_inorganic!=-1 )
+                if ( temp_inorganic>=0 && temp_inorganic< ( int ) snap.inorganics.size() )
                 {
-                    mat = world->raws.inorganics[temp_inorganic]->id;
+                    matname = snap.inorganics[temp_inorganic].c_str();
                 }
-                else
+                if ( ctx.resolved!=NULL )
                 {
-                    mat.clear();
+                    resolved = ctx.resolved->getMat ( tiletype,matname[0]!='\0' ? temp_inorganic : -1 );
                 }
             }
             else if (tilemat == tiletype_material::CONSTRUCTION)
@@ -2211,23 +4836,25 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                 mat.clear();
                 consmat.clear();
                 uint32_t index = getMapIndex ( dfx,dfy,zzz );
-                map<uint32_t,myConstruction>::iterator it;
-                it = Constructions.find ( index );
-                if ( it!=Constructions.end() )
+                map<uint32_t,myConstruction>::const_iterator it;
+                it = snap.constructions.find ( index );
+                if ( it!=snap.constructions.end() )
                 {
-                    getConsMats ( out, mat,  consmat, it->second.mat_type, it->second.mat_idx, it->second.form, tempstr,dfx,dfy,zzz );
+                    getConsMats ( ctx, snap, mat,  consmat, it->second.mat_type, it->second.mat_idx, it->second.form, tempstr,dfx,dfy,zzz );
                 }
                 else
                 {
                     mat="unknown";
                     consmat="unknown";
                 }
+                matname = mat.c_str();
             }
 
             char classname[128];
-            std::string plant;
+            const char *plant = "";
             classname[0]='\0';
-            int variant = tileVariant(tiletype);
+            int variant = getTileVariant ( tiletype );
+            int plantidx = -1;
             uint8_t* object = NULL;
             switch ( tileShape(tiletype) )
             {
@@ -2235,28 +4862,30 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
             case tiletype_shape::SAPLING:
             case tiletype_shape::SHRUB:
             {
-                map<uint32_t,std::string>::iterator vit;
-                vit = vegs.find ( getMapIndex ( dfx,dfy,zzz ) );
-                if ( vit!=vegs.end() )
+                map<uint32_t,int16_t>::const_iterator vit;
+                vit = snap.vegs.find ( getMapIndex ( dfx,dfy,zzz ) );
+                const myShapeResult *shape = NULL;
+                if ( vit!=snap.vegs.end() && vit->second>=0 && vit->second< ( int ) snap.plants.size() )
                 {
-                    plant = vit->second;
-                    snprintf ( classname,127,"%s.%s",TileClassNames[tileShape(tiletype)],plant.c_str() );
+                    plantidx = vit->second;
+                    plant = snap.plants[plantidx].c_str();
+                    snprintf ( classname,127,"%s.%s",TileClassNames[tileShape(tiletype)],plant );
+                    if ( ctx.resolved!=NULL )
+                        shape = ctx.resolved->getPlantShape ( getPlantSlot ( tileShape(tiletype) ),plantidx );
                 }
                 else
                 {
-                    out.print ( "Cant find plant that should already be defined!\n" );
+                    ctxPrint ( ctx, false, "Cant find plant that should already be defined!\n" );
                 }
 
-                object = getPlant ( out, uio,dfx, dfy, zzz,classname, TileMaterialNames[tileMaterial(tiletype)], variant, tileName(tiletype), mat.c_str() );
+                object = getPlant ( ctx,dfx, dfy, zzz,classname, TileMaterialNames[tileMaterial(tiletype)], variant, tileName(tiletype), matname, true, shape );
             }
             break;
             case tiletype_shape::RAMP:
             {
                 if ( classname[0]=='\0' )
                 {
-                    char dir[16];
-                    getObjDir ( out, &Block,uio,dir,dfx,dfy,zzz,dfblockx,dfblocky,"ramp",TileMaterialNames[tileMaterial(tiletype)], variant, tileName(tiletype), mat.c_str(),consmat.c_str() );
-                    snprintf ( classname,127,"%s%s",TileClassNames[tileShape(tiletype)],dir );
+                    snprintf ( classname,127,"%s%s",TileClassNames[tileShape(tiletype)],getObjDir ( rampClass,wallmask[dfoffsetx][dfoffsety] ) );
                 }
             }
             break;
@@ -2275,60 +4904,54 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                 {
                     if ( directionalWalls )
                     {
-                        char dir[16];
-                        getObjDir ( out, &Block,uio,dir,dfx,dfy,zzz,dfblockx,dfblocky,TileClassNames[tileShape(tiletype)],TileMaterialNames[tileMaterial(tiletype)], variant, tileName(tiletype), mat.c_str(),consmat.c_str() );
-                        snprintf ( classname,127,"%s%s",TileClassNames[tileShape(tiletype)],dir );
+                        snprintf ( classname,127,"%s%s",TileClassNames[tileShape(tiletype)],getObjDir ( tileShape(tiletype),wallmask[dfoffsetx][dfoffsety] ) );
                     }
                     else
                     {
                         strncpy ( classname,TileClassNames[tileShape(tiletype)],127 );
                     }
-
-                    //FIXME: smooth is a property of tile. smooth is also a designation meant to make dwarves avtualy do the smoothing.
-                    // See tiletype_special::SMOOTH
-                    if ( tileName(tiletype)!=NULL && strnicmp ( tileName(tiletype),"smooth",5 ) ==0 )  //doing this as des.smooth never seems to be set.
-                    {
-                        variant+=10;//and if I could figure out engraved it would be 20 over base variant
-                    }
                 }
 
             }
 
             if ( tileMaterial(tiletype) == tiletype_material::FROZEN_LIQUID )  //ice. or solidified magma, although the game doesn't really support that by default ... :)
             {
-                biome = 1;
+                ctx.biome = 1;
             }
 
             if ( tileName(tiletype) == NULL )
             {
-                out.print ( "Unknown tile type at %d,%d layer %d - id is %d, DFHAck needs description\n",dfx,dfy,zzz,tiletype );
-                stats[TERRAIN][UNKNOWN]++;
+                ctxPrint ( ctx, false, "Unknown tile type at %d,%d layer %d - id is %d, DFHAck needs description\n",dfx,dfy,zzz,tiletype );
+                ctx.stats[TERRAIN][UNKNOWN]++;
             }
 
             if ( object==NULL )
-                object = getTerrain ( out, uio,dfx, dfy, zzz,classname, TileMaterialNames[tileMaterial(tiletype)], variant, tileName(tiletype), mat.c_str(), consmat.c_str(),true );
+                object = getTerrain ( ctx,dfx, dfy, zzz,classname, TileMaterialNames[tileMaterial(tiletype)], variant, tileName(tiletype), matname, consmat.c_str(),true,resolved );
 
             //now copy object in to mclayer array
-            addObject ( mclayers, mcdata, object,  dfx,  dfy, zzz, xoffset, yoffset, zcount, mcxsquares, mcysquares );
+            addObject ( world, object,  dfx,  dfy, zzz, xoffset, yoffset, zcount );
 
 
             //add tree top if tree
             if ( ( tileShape(tiletype) == tiletype_shape::TREE ) && ( ( zcount+1 ) < limitlevels ) )
             {
-                snprintf ( classname,127,"%s.%s","treetop",plant.c_str() );
-                object = getPlant ( out, uio,dfx, dfy, zzz,classname, "air", variant, tileName(tiletype), mat.c_str() );
+                snprintf ( classname,127,"%s.%s","treetop",plant );
+                const myShapeResult *shape = NULL;
+                if ( ctx.resolved!=NULL )
+                    shape = ctx.resolved->getPlantShape ( PLANT_SHAPES-1,plantidx );
+                object = getPlant ( ctx,dfx, dfy, zzz,classname, "air", variant, tileName(tiletype), matname, true, shape );
                 if ( object!=NULL )
-                    addObject ( mclayers, mcdata, object,  dfx,  dfy, zzz+1, xoffset, yoffset, zcount+1, mcxsquares, mcysquares );
+                    addObject ( world, object,  dfx,  dfy, zzz+1, xoffset, yoffset, zcount+1 );
             }
 
 
             //Add building if any (furnaces/forge to furnace, others to workbench, make 'tables'/chests to block impassible squares
             uint32_t index = getMapIndex ( dfx,dfy,zzz );
-            map<uint32_t,myBuilding>::iterator it;
-            it = Buildings.find ( index );
-            if ( it!=Buildings.end() )
+            map<uint32_t,myBuilding>::const_iterator it;
+            it = snap.buildings.find ( index );
+            if ( it!=snap.buildings.end() )
             {
-                myBuilding mb = it->second;
+                const myBuilding &mb = it->second;
                 mat="unknown";
                 char *specmat = NULL;
                 int form = item_type::BLOCKS;
@@ -2346,7 +4969,7 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                     //constr_bar
                 }
 
-                getConsMats ( out, mat, consmat, mb.material.type, mb.material.index, form, tempstr, dfx, dfy, zzz );
+                getConsMats ( ctx, snap, mat, consmat, mb.material.type, mb.material.index, form, tempstr, dfx, dfy, zzz );
 
                 char building[256];
                 snprintf ( building,255,"%s.%s",mb.type,mb.desc );
@@ -2358,19 +4981,19 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                 {
                     toFace = it->second;
                 }
-                int dir = getBuildingDir ( out, Buildings, &Block, uio,dfx,dfy,zzz,dfblockx,dfblocky,building,mat.c_str(),"building",specmat,toFace.c_str() );
+                int dir = getBuildingDir ( snap,dfx,dfy,zzz,wallmask[dfoffsetx][dfoffsety],building,toFace.c_str() );
 
                 snprintf ( building,255,"%s.%s",mb.type,mb.desc );
                 building[255]='\0';
 
-                object = getBuilding ( out, uio,dfx, dfy, zzz, building, dir, mat.c_str(), "building", specmat );
+                object = getBuilding ( ctx,dfx, dfy, zzz, building, dir, mat.c_str(), "building", specmat );
                 if ( object!=NULL )
                 {
-                    addObject ( mclayers, mcdata, object,  dfx,  dfy, zzz, xoffset, yoffset, zcount, mcxsquares, mcysquares );
+                    addObject ( world, object,  dfx,  dfy, zzz, xoffset, yoffset, zcount );
                 }
                 else
                 {
-                    out.printerr ( "Cant find building that should already be defined!\n" );
+                    ctxPrint ( ctx, true, "Cant find building that should already be defined!\n" );
                 }
             }
 
@@ -2390,10 +5013,10 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
 
                 snprintf ( classname,127,"%s.%d",type,des.bits.flow_size );
 
-                object = getFlow ( uio,dfx, dfy, zzz, classname, type ,des.bits.flow_size );
+                object = getFlow ( ctx,dfx, dfy, zzz, classname, type ,des.bits.flow_size );
                 if ( object!=NULL )
                 {
-                    addObject ( mclayers, mcdata, object,  dfx,  dfy, zzz, xoffset, yoffset, zcount, mcxsquares, mcysquares );
+                    addObject ( world, object,  dfx,  dfy, zzz, xoffset, yoffset, zcount );
                 }
             }
 
@@ -2408,9 +5031,9 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                 bool mud = false;
                 for ( int v = 0; v < ( int ) splatter.size() &&!mud;v++ )
                 {
-                    if ( splatter[v]->mat_type=0xC )  //magic number for mud - see cleanmap.cpp - turns out not really - this is any spatter, mud, blood, vomit, etc.
+                    if ( splatter[v].mat_type=0xC )  //magic number for mud - see cleanmap.cpp - turns out not really - this is any spatter, mud, blood, vomit, etc.
                     {
-                        if ( splatter[v]->amount[dfoffsetx][dfoffsety]>0 )
+                        if ( splatter[v].amount[dfoffsetx][dfoffsety]>0 )
                         {
                             mud=true; //yes, this tile is muddy
                         }
@@ -2428,7 +5051,7 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                     if ( des.bits.subterranean > 0 ) //what are possible values
                         percent = max ( percent,torchPerSubter );
 
-                    if ( ( rand() %100 ) <percent )
+                    if ( ( tileRandom ( dfx,dfy,zzz ) %100 ) < ( uint32_t ) percent )
                     {
                         //ok, try to add a torch here
 
@@ -2438,11 +5061,11 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
                         {
                             toFace = it->second;
                         }
-                        int dir = getBuildingDir ( out, Buildings, &Block, uio,dfx,dfy,zzz,dfblockx,dfblocky,"torch","air",NULL,NULL,toFace.c_str() );
+                        int dir = getBuildingDir ( snap,dfx,dfy,zzz,wallmask[dfoffsetx][dfoffsety],"torch",toFace.c_str() );
 
-                        object = getBuilding ( out, uio,dfx, dfy, zzz, "torch", dir, "air" );
+                        object = getBuilding ( ctx,dfx, dfy, zzz, "torch", dir, "air" );
                         if ( object!=NULL )
-                            addObject ( mclayers, mcdata, object,  dfx,  dfy, zzz, xoffset, yoffset, zcount, mcxsquares, mcysquares );
+                            addObject ( world, object,  dfx,  dfy, zzz, xoffset, yoffset, zcount );
 
                     }
                 }
@@ -2451,36 +5074,19 @@ void convertDFBlock ( color_ostream & out, vector< vector <uint16_t> > layerassi
     }
 }
 
-int convertMaps ( color_ostream & out )
+int snapshotDFMap ( color_ostream & out, mySnapshot & snap )
 {
+    //everything that reads Dwarf Fortress memory is done in here, the core only
+    //needs to be suspended while this runs
 
     out.print ( "\nCalculating size limit...\n" );
+    myPhaseTimer levelTimer ( exportStats.phases[PHASE_LEVELS] );
 
     //setup
 
     uint32_t x_max,y_max,z_max;
-    vector<DFHack::t_feature> global_features;
-    std::map <DFHack::planecoord, std::vector<DFHack::t_feature *> > local_features;
-    vector< vector <uint16_t> > layerassign;
-
     uint16_t cloudheight=0;
 
-    //create xml file for a list of full unimplemented objects
-    TiXmlElement *uio = NULL;
-    if ( createUnknown )
-    {
-        TiXmlDocument *doc = new TiXmlDocument ( "hack/unimplementedobjects.xml" );
-        bool loadOkay = doc->LoadFile();
-        uio=doc->FirstChildElement ( "unimplemented_objects" );
-        if ( uio==NULL )
-        {
-            uio = new TiXmlElement ( "unimplemented_objects" );
-            doc->LinkEndChild ( uio );
-            TiXmlComment *comment = new TiXmlComment ( "These elements are the most specific elements that make up the maps that you have converted\nIf something doesn't look right in the converted map, try to fix the object here,\nspecify how it should look in Minecraft, and copy that object into the hack/df2mc.xml file" );
-            uio->LinkEndChild ( comment );
-        }
-    }
-
     // init the map
     if ( !Maps::IsValid() )
     {
@@ -2488,6 +5094,9 @@ int convertMaps ( color_ostream & out )
         return 103;
     }
     Maps::getSize ( x_max,y_max,z_max );
+    snap.mapx = x_max;
+    snap.mapy = y_max;
+    snap.mapz = z_max;
 
     out.print ( "DF Map size in \'blocks\' %dx%d with %d levels (a 3x3 block is one embark space)\n",x_max,y_max,z_max );
     out.print ( "DF Map size in squares %d, %d, %d\n",x_max*SQUARESPERBLOCK,y_max*SQUARESPERBLOCK,z_max );
@@ -2656,47 +5265,35 @@ int convertMaps ( color_ostream & out )
     }
 
 
-    //setup variables and get data from Dwarf Fortress
-    int dfxsquares = ( x_max-xoffset ) *SQUARESPERBLOCK ;
-    int dfysquares = ( y_max-yoffset ) *SQUARESPERBLOCK;
-    int dfzsquares = ( limitlevels );
-    int mcxsquares = dfxsquares * squaresize;
-    int mcysquares = dfysquares * squaresize;
-    int mczsquares = dfzsquares * squaresize+1;
-
-    if ( z_max>limitlevels )
-    {
-        out.print ( "DF Map size cut down to %d, %d, %d squares\n",dfxsquares,dfysquares, dfzsquares );
-    }
-    if ( mczsquares<128 ) mczsquares = 128;//this should be the case (<128) most of the time
-    out.print ( "MC Map size will be %d, %d, %d squares\n",mcxsquares,mcysquares, mczsquares );
-    out.print ( "plus surrounding random terrain using seed: %I64d\n",seed );
-
-    if ( mcxsquares<0 || mcysquares<0 || mczsquares<0 )
-    {
-        out.printerr ( "Area too small\n" );
-        return 20;
-    }
+    snap.x_max = x_max;
+    snap.y_max = y_max;
+    snap.z_max = z_max;
+    snap.xoffset = xoffset;
+    snap.yoffset = yoffset;
+    levelTimer.stop();
 
     // get region geology
-    if ( !Maps::ReadGeology ( layerassign ) )
+    myPhaseTimer geologyTimer ( exportStats.phases[PHASE_GEOLOGY] );
+    if ( !Maps::ReadGeology ( snap.layerassign ) )
     {
         out.printerr ("Can't get region geology.\n");
         return 106;
     }
+    geologyTimer.stop ( snap.layerassign.size() );
 
 
     out.print ( "\nReading Plants... " );
+    myPhaseTimer plantTimer ( exportStats.phases[PHASE_PLANTS] );
     uint32_t numVegs = Vegetation::getCount();
 
     //read vegetation into a map for faster access later
-    map<uint32_t,std::string> vegs;
     for ( uint32_t i =0; i < numVegs; i++ )
     {
         df::plant * p = Vegetation::getPlant(i);
-        vegs[getMapIndex ( p->pos.x,p->pos.y,p->pos.z ) ] = df::global::world->raws.plants.all[p->material]->id;
+        snap.vegs[getMapIndex ( p->pos.x,p->pos.y,p->pos.z ) ] = p->material;
     }
-    out.print ( "%d\n",vegs.size() );
+    plantTimer.stop ( numVegs );
+    out.print ( "%d\n",snap.vegs.size() );
 
 
     
@@ -2706,7 +5303,6 @@ int convertMaps ( color_ostream & out )
     uint32_t numBuildings = 0;
     //DFHack::Position * Pos = DF->getPosition();
 
-    map<uint32_t,myBuilding> Buildings;
     //FIXME: this is so totally different it's not even funny. Disabled for now.
     /*
     numBuildings = Buildings::getNumBuildings();
@@ -2801,164 +5397,438 @@ int convertMaps ( color_ostream & out )
 
                     if ( strcmp ( mb->type,"stockpile" ) ==0 )
                     {
-                        if ( Buildings.find ( index ) ==Buildings.end() )
+                        if ( snap.buildings.find ( index ) ==Buildings.end() )
                         {
-                            Buildings[index] = *mb;
+                            snap.buildings[index] = *mb;
                             //                      }else{
                             //                          DFConsole->print("Not replacing a building with a stockpile\n");
                         }
                     }
                     else
                     {
-                        Buildings.erase ( index );
-                        Buildings[index] = *mb;
+                        snap.buildings.erase ( index );
+                        snap.buildings[index] = *mb;
                     }
                 }
             }
 
         }
     }
-    DFConsole->print ( "%d\n",Buildings.size() );
-    */
-
-
-    //Constructions
-    out.print ( "Reading Constructions... " );
-    uint32_t numConstr = Constructions::getCount();
-    map<uint32_t,myConstruction> Constructions;
-    myConstruction *consmats = new myConstruction[numConstr];
+    DFConsole->print ( "%d\n",snap.buildings.size() );
+    */
+
+
+    //Constructions
+    out.print ( "Reading Constructions... " );
+    myPhaseTimer constructionTimer ( exportStats.phases[PHASE_CONSTRUCTIONS] );
+    uint32_t numConstr = Constructions::getCount();
+    myConstruction *consmats = new myConstruction[numConstr];
+
+    for ( uint32_t i = 0; i < numConstr; i++ )
+    {
+        df::construction * con = Constructions::getConstruction ( i );
+
+        consmats[i].mat_type = con->mat_type;
+        consmats[i].mat_idx = con->mat_index;
+        consmats[i].form = con->item_type;
+
+        uint32_t index = getMapIndex ( con->pos.x,con->pos.y,con->pos.z );
+        snap.constructions[index] = consmats[i];
+    }
+    delete[] consmats;
+    constructionTimer.stop ( numConstr );
+    out.print ( "%d\n",snap.constructions.size() );
+
+    //raw names, so material lookups don't have to go back to DF
+    for ( size_t i=0;i<world->raws.inorganics.size();i++ )
+        snap.inorganics.push_back ( world->raws.inorganics[i]->id );
+    for ( size_t i=0;i<world->raws.plants.all.size();i++ )
+        snap.plants.push_back ( world->raws.plants.all[i]->id );
+    for ( size_t i=0;i<world->raws.creatures.all.size();i++ )
+        snap.creatures.push_back ( world->raws.creatures.all[i]->creature_id );
+
+    Gui::getCursorCoords ( snap.cursorx, snap.cursory, snap.cursorz );
+
+
+    //copy the blocks on the output levels, plus a ring of neighbors for directional walls
+    out.print ( "Copying Map Blocks... " );
+    myPhaseTimer blockTimer ( exportStats.phases[PHASE_BLOCKS] );
+    uint32_t numBlocks = 0;
+    snap.blocks.resize ( snap.mapx*snap.mapy*snap.mapz, NULL );
+    for ( uint32_t zzz = 0; zzz< z_max;zzz++ )
+    {
+        if ( limitz[zzz]==0 )
+            continue;
+        for ( uint32_t dfblockx = ( xoffset>0?xoffset-1:0 ); dfblockx< min ( x_max+1,snap.mapx );dfblockx++ )
+        {
+            for ( uint32_t dfblocky = ( yoffset>0?yoffset-1:0 ); dfblocky< min ( y_max+1,snap.mapy );dfblocky++ )
+            {
+                if ( !Maps::getBlock ( dfblockx,dfblocky,zzz ) )
+                    continue;
+
+                myBlock *B = new myBlock;
+                Maps::ReadBlock40d ( dfblockx,dfblocky,zzz, &B->block );
+
+                vector<df::block_square_event_mineralst *> veins;
+                vector<df::block_square_event_material_spatterst *> splatter;
+                Maps::SortBlockEvents ( dfblockx,dfblocky,zzz,&veins,NULL,&splatter );
+                B->veins.resize ( veins.size() );
+                for ( size_t v=0;v<veins.size();v++ )
+                {
+                    B->veins[v].inorganic_mat = veins[v]->inorganic_mat;
+                    memcpy ( B->veins[v].tile_bitmask,veins[v]->tile_bitmask,sizeof ( B->veins[v].tile_bitmask ) );
+                }
+                B->splatter.resize ( splatter.size() );
+                for ( size_t v=0;v<splatter.size();v++ )
+                {
+                    B->splatter[v].mat_type = splatter[v]->mat_type;
+                    memcpy ( B->splatter[v].amount,splatter[v]->amount,sizeof ( B->splatter[v].amount ) );
+                }
+
+                Maps::ReadFeatures ( dfblockx,dfblocky,zzz,&B->local, &B->global );
+
+                snap.blocks[ ( zzz*snap.mapy + dfblocky ) *snap.mapx + dfblockx] = B;
+                numBlocks++;
+            }
+        }
+    }
+    blockTimer.stop ( numBlocks );
+    out.print ( "%d (%d KB)\n",numBlocks, ( int ) ( numBlocks* ( sizeof ( myBlock ) ) /1024 ) );
+
+    return 0;
+}
+
+struct myLevelJob
+{
+    const mySnapshot *snap;
+    myWorld *world;
+    uint32_t zzz;
+    uint32_t zcount;
+    std::vector<uint32_t> blockx;
+    std::vector<uint32_t> blocky;
+    std::vector<myConvertContext> contexts;
+    myMaterialCache *matCaches;     //one per thread
+    myObjectCache *objCaches;       //one per thread
+    const myResolvedMats *resolved;
+};
+
+void convertLevelBlock ( void *arg, int item, int worker )
+{
+    myLevelJob *level = ( myLevelJob* ) arg;
+    level->contexts[item].matCache = &level->matCaches[worker];
+    level->contexts[item].objCache = &level->objCaches[worker];
+    level->contexts[item].resolved = level->resolved;
+    convertDFBlock ( level->contexts[item], *level->snap, *level->world,
+                     level->blockx[item], level->blocky[item], level->zzz, level->zcount,
+                     level->snap->xoffset, level->snap->yoffset );
+}
+
+void mergeContext ( color_ostream & out, TiXmlElement *uio, myConvertContext & ctx )
+{
+    //blocks on a level are converted side by side, so each block missing a material creates it. One at a time, only
+    //the first would have and the rest would have found it, so their reports are changed to what that finds
+    std::vector<bool> dropMessage ( ctx.messages.size(),false );
+    std::vector<bool> dropUnknown ( ctx.unknowns.size(),false );
+    for ( size_t i=0;i<ctx.missing.size();i++ )
+    {
+        const myMissingMat &m = ctx.missing[i];
+        if ( dfMats.find ( m.basic ) ==dfMats.end() )
+            continue;
+        if ( m.addstats )
+        {
+            dropMessage[m.message] = true;
+            ctx.stats[MATERIALS][UNKNOWN]--;
+            ctx.stats[MATERIALS][m.perfect ? PERFECT : IMPERFECT]++;
+        }
+        //a perfect match isn't unimplemented, an imperfect one is recorded the same as a missing one
+        if ( m.perfect )
+            dropUnknown[m.unknown] = true;
+    }
+
+    for ( size_t i=0;i<ctx.messages.size();i++ )
+    {
+        if ( dropMessage[i] )
+            continue;
+        if ( ctx.messages[i].first )
+            out.printerr ( "%s",ctx.messages[i].second.c_str() );
+        else
+            out.print ( "%s",ctx.messages[i].second.c_str() );
+    }
+
+    for ( int i=0;i<STAT_AREAS;i++ )
+    {
+        for ( int j=0;j<STAT_TYPES;j++ )
+        {
+            stats[i][j] += ctx.stats[i][j];
+        }
+    }
 
-    for ( uint32_t i = 0; i < numConstr; i++ )
+    for ( std::map<std::string,uint8_t*>::iterator it = ctx.newMats.begin(); it!=ctx.newMats.end(); it++ )
     {
-        df::construction * con = Constructions::getConstruction ( i );
-
-        consmats[i].mat_type = con->mat_type;
-        consmats[i].mat_idx = con->mat_index;
-        consmats[i].form = con->item_type;
+        if ( dfMats.find ( it->first ) !=dfMats.end() )
+        {
+            //another block on this level created it first
+            delete[] it->second;
+            continue;
+        }
+        dfMats[it->first] = it->second;
+        dfMatsGeneration++;
 
-        uint32_t index = getMapIndex ( con->pos.x,con->pos.y,con->pos.z );
-        Constructions[index] = consmats[i];
+        //add the new material to hack/df2mc.xml
+        TiXmlElement *elm = new TiXmlElement ( it->first.c_str() );
+        elm->SetAttribute ( "mat",makeAirArray() );
+        elm->SetAttribute ( "data","" );
+        xmlmaterials->LinkEndChild ( elm );
     }
-    out.print ( "%d\n",Constructions.size() );
-
 
-
-    //allocate memory for blocks and data
-    uint8_t* mclayers = new uint8_t[mcxsquares*mcysquares*mczsquares];
-    uint8_t* mcdata = new uint8_t[mcxsquares*mcysquares*mczsquares];
-    uint8_t* mcskylight = new uint8_t[mcxsquares*mcysquares*mczsquares];
-    uint8_t* mcblocklight = new uint8_t[mcxsquares*mcysquares*mczsquares];
-    if ( mclayers==NULL || mcdata == NULL || mcskylight == NULL || mcblocklight == NULL )
+    for ( size_t i=0;i<ctx.unknowns.size();i++ )
     {
-        out.printerr ( "Unable to allocate memory to store level data, exiting." );
-        return 10;
+        if ( dropUnknown[i] )
+            continue;
+        myUnknown &u = ctx.unknowns[i];
+        addUnknown ( uio, u.section, u.name.c_str(), u.hasdata?u.data.c_str() :NULL, u.stattype );
     }
-    memset ( mclayers,0,sizeof ( uint8_t ) * ( mcxsquares*mcysquares*mczsquares ) );
-    memset ( mcdata,0,sizeof ( uint8_t ) * ( mcxsquares*mcysquares*mczsquares ) );
-    memset ( mcskylight,0,sizeof ( uint8_t ) * ( mcxsquares*mcysquares*mczsquares ) );
-    memset ( mcblocklight,0,sizeof ( uint8_t ) * ( mcxsquares*mcysquares*mczsquares ) );
 
+    if ( ctx.biome )
+        biome = 1;
 
+    ctx.messages.clear();
+    ctx.unknowns.clear();
+    ctx.newMats.clear();
+    ctx.missing.clear();
+}
 
-    //read DF map data and create MC map blocks and data arrays;
-    out.print ( "\nConverting Map...\n" );
+struct myResolveJob
+{
+    const mySnapshot *snap;
+    myResolvedMats *res;
+    std::vector<int> tiletypes;     //for each row
+};
 
-    // walk the DF map!
-    uint32_t zcount = 0;
-    for ( uint32_t zzz = 0; zzz< z_max;zzz++ )
+void resolveRow ( void *arg, int row, int /*worker*/ )
+{
+    myResolveJob *job = ( myResolveJob* ) arg;
+    df::tiletype tiletype = ( df::tiletype ) job->tiletypes[row];
+    myConvertContext ctx;//nothing is recorded, only the results are kept
+    for ( size_t c=0;c<job->res->columns;c++ )
     {
-        if ( limitz[zzz]==0 )
+        //same as getTerrain is called with for soil, stone and feature tiles
+        const char *spec = c>0 ? job->snap->inorganics[c-1].c_str() : NULL;
+        resolveMaterial ( ctx, job->res->mats[row*job->res->columns + c], TileMaterialNames[tileMaterial(tiletype)],
+                          getTileVariant ( tiletype ), tileName(tiletype), spec, "" );
+    }
+}
+
+void resolveRaws ( color_ostream & out, const mySnapshot & snap, myResolvedMats & res, int threads )
+{
+    //find the soil, stone and feature tile types used in the map
+    myResolveJob job;
+    job.snap = &snap;
+    job.res = &res;
+    for ( size_t b=0;b<snap.blocks.size();b++ )
+    {
+        if ( snap.blocks[b]==NULL )
             continue;
-        out.print ( "Layer %d/%d\t(%d/%d)\n",zzz,z_max,zcount,limitlevels );
-        for ( uint32_t dfblockx = xoffset; dfblockx< x_max;dfblockx++ )
+        const DFHack::mapblock40d &Block = snap.blocks[b]->block;
+        for ( int x=0;x<16;x++ )
         {
-            for ( uint32_t dfblocky = yoffset; dfblocky< y_max;dfblocky++ )
+            for ( int y=0;y<16;y++ )
             {
-
-                if ( Maps::getBlock ( dfblockx,dfblocky,zzz ) )
+                df::tiletype tiletype = Block.tiletypes[x][y];
+                df::tiletype_material tilemat = tileMaterial(tiletype);
+                if ( tilemat != tiletype_material::SOIL && tilemat != tiletype_material::STONE && tilemat != tiletype_material::FEATURE )
+                    continue;
+                if ( ( int ) tiletype>= ( int ) res.rowOf.size() )
+                    res.rowOf.resize ( tiletype+1,-1 );
+                if ( res.rowOf[tiletype]<0 )
                 {
-
-                    convertDFBlock ( out, layerassign, Constructions, Buildings, vegs,
-                                     uio, mclayers,mcdata,
-                                     dfblockx, dfblocky, zzz, zcount, xoffset, yoffset, mcxsquares, mcysquares );
-
+                    res.rowOf[tiletype] = ( int ) job.tiletypes.size();
+                    job.tiletypes.push_back ( tiletype );
                 }
-
             }
         }
+    }
 
-        //print stats
-        for ( int i=0;i<STAT_AREAS;i++ )
+    //every tile type crossed with every inorganic material
+    //only materials that were found are used, so the table can't be outdated by materials added during the conversion
+    //as those are only added under their basic name, which is the last name tried
+    res.columns = snap.inorganics.size() +1;
+    res.mats.resize ( job.tiletypes.size() *res.columns );
+    parallelFor ( threads, ( int ) job.tiletypes.size(), resolveRow, &job );
+
+    //plant shapes for every plant
+    const char *prefix[PLANT_SHAPES];
+    prefix[0] = TileClassNames[tiletype_shape::TREE];
+    prefix[1] = TileClassNames[tiletype_shape::SAPLING];
+    prefix[2] = TileClassNames[tiletype_shape::SHRUB];
+    prefix[3] = "treetop";
+    res.plantShapes.resize ( snap.plants.size() *PLANT_SHAPES );
+    char classname[128];
+    for ( size_t p=0;p<snap.plants.size();p++ )
+    {
+        for ( int i=0;i<PLANT_SHAPES;i++ )
         {
-            switch ( i )
-            {
-            case MATERIALS:
-                out.print ( " MATERIALS:\t" );
-                break;
-            case TERRAIN:
-                out.print ( " TERRAIN:  \t" );
-                break;
-            case FLOWS:
-                out.print ( " FLOWS:    \t" );
-                break;
-            case PLANTS:
-                out.print ( " PLANTS:   \t" );
-                break;
-            case BUILDINGS:
-                out.print ( " BUILDINGS:\t" );
-                break;
-            }
-            out.print ( "unknown: %d  imperfect: %d  perfect: %d  new: %d\n",stats[i][UNKNOWN],stats[i][IMPERFECT],stats[i][PERFECT],stats[i][UNSEEN] );
+            snprintf ( classname,127,"%s.%s",prefix[i],snap.plants[p].c_str() );
+            findPlantShape ( res.plantShapes[p*PLANT_SHAPES+i],classname );
         }
+    }
+
+    out.print ( "Resolved %d materials and %d plant shapes\n", ( int ) res.mats.size(), ( int ) res.plantShapes.size() );
+}
 
-        zcount++;
+//prints the phase timings and saves them as JSON beside the world directory, so exports can be compared later
+void reportExport ( color_ostream & out, const char *dirname )
+{
+    const myExportStats &st = exportStats;
+    int64_t total = getMicros()-st.start;
+    int64_t totalCpu = 0;
+    for ( int i=0;i<PHASES;i++ )
+        totalCpu += st.phases[i].cpu;
+    const myPhaseTime &conv = st.phases[PHASE_CONVERT];
+    double convSecs = max ( conv.wall, ( int64_t ) 1 ) /1000000.0;
+
+    out.print ( "\nPhase                     wall s     cpu s      count\n" );
+    for ( int i=0;i<PHASES;i++ )
+    {
+        //packing and compression run side by side on the chunk workers, their times are added up over the threads
+        bool threads = i==PHASE_PACK || i==PHASE_COMPRESS;
+        out.print ( " %-20s %10.2f%s %9.2f %10lld\n",phaseNames[i],st.phases[i].wall/1000000.0,threads ? "*" : " ",
+                    st.phases[i].cpu/1000000.0, ( long long ) st.phases[i].count );
+    }
+    out.print ( " %-20s %10.2f  %9.2f\n","total",total/1000000.0,totalCpu/1000000.0 );
+    out.print ( " * thread time, added up over the chunk workers\n" );
+    out.print ( "%lld tiles, %.0f tiles/s, %lld voxels, %.0f voxels/s, %lld KB written\n", ( long long ) st.tiles,st.tiles/convSecs,
+                ( long long ) st.voxels,st.voxels/convSecs, ( long long ) ( st.bytes/1024 ) );
+
+    char path[300];
+    snprintf ( path,299,"%s.timings.json",dirname );
+    path[299]='\0';
+    FILE *f = fopen ( path,"w" );
+    if ( f==NULL )
+    {
+        out.printerr ( "Could not write %s\n",path );
+        return;
+    }
+    static const char *outputNames[3] = { "alpha","mcregion","anvil" };
+    fprintf ( f,"{\n" );
+    fprintf ( f,"  \"world\": \"%s\",\n",dirname );
+    fprintf ( f,"  \"output\": \"%s\",\n",outputNames[outputType] );
+    fprintf ( f,"  \"compression\": \"%s\",\n",compression->name );
+    fprintf ( f,"  \"squaresize\": %d,\n",squaresize );
+    fprintf ( f,"  \"threads\": %d,\n",getThreadCount() );
+    fprintf ( f,"  \"wall_seconds\": %.6f,\n",total/1000000.0 );
+    fprintf ( f,"  \"cpu_seconds\": %.6f,\n",totalCpu/1000000.0 );
+    fprintf ( f,"  \"tiles\": %lld,\n", ( long long ) st.tiles );
+    fprintf ( f,"  \"voxels\": %lld,\n", ( long long ) st.voxels );
+    fprintf ( f,"  \"tiles_per_second\": %.1f,\n",st.tiles/convSecs );
+    fprintf ( f,"  \"voxels_per_second\": %.1f,\n",st.voxels/convSecs );
+    fprintf ( f,"  \"bytes_written\": %lld,\n", ( long long ) st.bytes );
+    fprintf ( f,"  \"phases\": [\n" );
+    for ( int i=0;i<PHASES;i++ )
+    {
+        fprintf ( f,"    {\"name\": \"%s\", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"count\": %lld}%s\n",phaseNames[i],
+                  st.phases[i].wall/1000000.0,st.phases[i].cpu/1000000.0, ( long long ) st.phases[i].count,i+1<PHASES ? "," : "" );
+    }
+    fprintf ( f,"  ],\n" );
+    //only the levels that were converted, by their DF z-level
+    fprintf ( f,"  \"levels\": [" );
+    bool first = true;
+    for ( size_t z=0;z<st.levels.size();z++ )
+    {
+        if ( st.levels[z].count==0 )
+            continue;
+        fprintf ( f,"%s\n    {\"z\": %d, \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"tiles\": %lld}",first ? "" : ",", ( int ) z,
+                  st.levels[z].wall/1000000.0,st.levels[z].cpu/1000000.0, ( long long ) st.levels[z].count );
+        first = false;
     }
+    fprintf ( f,"\n  ]\n}\n" );
+    fclose ( f );
+    out.print ( "Timings saved to %s\n",path );
+}
 
-    if ( uio!=NULL )
+int convertWorld ( color_ostream & out, const mySnapshot & snap )
+{
+
+    uint32_t x_max = snap.x_max;
+    uint32_t y_max = snap.y_max;
+    uint32_t z_max = snap.z_max;
+    uint32_t xoffset = snap.xoffset;
+    uint32_t yoffset = snap.yoffset;
+
+    //create xml file for a list of full unimplemented objects
+    TiXmlElement *uio = NULL;
+    if ( createUnknown )
     {
-        if ( uio->GetDocument() !=NULL )
+        TiXmlDocument *doc = new TiXmlDocument ( "hack/unimplementedobjects.xml" );
+        bool loadOkay = doc->LoadFile();
+        uio=doc->FirstChildElement ( "unimplemented_objects" );
+        if ( uio==NULL )
         {
-            uio->GetDocument()->SaveFile();
-            delete uio->GetDocument();
+            uio = new TiXmlElement ( "unimplemented_objects" );
+            doc->LinkEndChild ( uio );
+            TiXmlComment *comment = new TiXmlComment ( "These elements are the most specific elements that make up the maps that you have converted\nIf something doesn't look right in the converted map, try to fix the object here,\nspecify how it should look in Minecraft, and copy that object into the hack/df2mc.xml file" );
+            uio->LinkEndChild ( comment );
         }
     }
 
+    //setup variables
+    int dfxsquares = ( x_max-xoffset ) *SQUARESPERBLOCK ;
+    int dfysquares = ( y_max-yoffset ) *SQUARESPERBLOCK;
+    int dfzsquares = ( limitlevels );
+    //MC's x runs along DF's y and MC's y along DF's x, see addObject
+    int mcxsquares = dfysquares * squaresize;
+    int mcysquares = dfxsquares * squaresize;
+    int mczsquares = dfzsquares * squaresize+1;
 
-    //add bottom layer of adminium
-    for ( int oy=0;oy<mcxsquares;oy++ )
+    if ( z_max>limitlevels )
     {
-        for ( int ox=0;ox<mcysquares;ox++ )
-        {
+        out.print ( "DF Map size cut down to %d, %d, %d squares\n",dfxsquares,dfysquares, dfzsquares );
+    }
+    if ( mczsquares<128 ) mczsquares = 128;//this should be the case (<128) most of the time
+    out.print ( "MC Map size will be %d, %d, %d squares\n",mcxsquares,mcysquares, mczsquares );
+    out.print ( "plus surrounding random terrain using seed: %I64d\n",seed );
 
-            //Index = x + (y * Depth + z) * Width //where y is up down
-            int idx = ox + ( oy ) * mcxsquares;
-            mclayers[idx]=7; // bedrock / adminium
-        }
+    if ( mcxsquares<0 || mcysquares<0 || mczsquares<0 )
+    {
+        out.printerr ( "Area too small\n" );
+        return 20;
     }
 
+    char dirname[256];
+    if ( makeLevelDir ( NULL, dirname ) !=0 )
+    {
+        out.printerr ( "Unable to create the world directory\n" );
+        return 23;
+    }
 
-    //place the spawn at DF cursor location, if within output area and not a wall
-    out.print ( "\nPlancing spawn location\n" );
+    //the world starts empty, sections are allocated as they are written to
+    myWorld world;
+    world.init ( mcxsquares, mcysquares, mczsquares );
+
+    //the spawn goes at the DF cursor if there is room there, otherwise on top of the middle of the map
+    //both are looked for as soon as their columns are converted, as the rest of the world isn't kept around
     int32_t cx, cy, cz,ocx,ocy,ocz;
-    Gui::getCursorCoords ( ocx,ocy,ocz );
+    ocx=snap.cursorx;
+    ocy=snap.cursory;
+    ocz=snap.cursorz;
     cx=ocx;
     cy=ocy;
     cz=ocz;
+    int zcnt = 0;
+    bool cursorSpawn = false;
     if ( cx != -30000 && cx>=0 && cy>=0 && cz>=0 )
     {
         //see if it is in an output layer (should be if a open space was chosen)
-        if ( limitz[cz]=255 )
+        if ( cz<1000 && limitz[cz] )
         {
             if ( ( ( limitxmin*SQUARESPERBLOCK ) <= ( uint32_t ) cx ) && ( ( limitxmax*SQUARESPERBLOCK ) >= ( uint32_t ) cx ) &&
                     ( ( limitymin*SQUARESPERBLOCK ) <= ( uint32_t ) cy ) && ( ( limitymax*SQUARESPERBLOCK ) >= ( uint32_t ) cy ) )
             {
-
                 //convert to MC index - need to rotate - need to position from NW with +x going south and +y going west (I think)
-                bool ok = false;
                 int32_t temp = cx;
                 cx = cy * squaresize - ( yoffset*SQUARESPERBLOCK*squaresize ) + ( squaresize/2 );
-                cy = mcxsquares - ( ( temp * squaresize - ( xoffset*SQUARESPERBLOCK*squaresize ) ) + ( squaresize/2 ) );
-                int zcnt = 0; //we need to count the number of included levels from here to the bottom as that is the actual layer height in minecraft
+                cy = mcysquares - ( ( temp * squaresize - ( xoffset*SQUARESPERBLOCK*squaresize ) ) + ( squaresize/2 ) );
+                //we need to count the number of included levels from here to the bottom as that is the actual layer height in minecraft
                 for ( int k=cz-1;k>=0;k-- )
                 {
                     if ( limitz[k]>0 )
@@ -2966,14 +5836,114 @@ int convertMaps ( color_ostream & out )
                         zcnt++;
                     }
                 }
+                cursorSpawn = true;
+            }
+            if ( !cursorSpawn || cx<0 || cy<0 || cx>=mcxsquares || cy>=mcysquares )
+            {
+                out.print ( "DF Cursor outside of area output on this level\nSetting spawn to top center of area\n" );
+                cursorSpawn = false;
+            }
+        }
+        else
+        {
+            out.print ( "DF Cursor on level not being output\nSetting spawn to top center of area\n" );
+        }
+    }
+    int centerx = mcxsquares/2;
+    int centery = mcysquares/2;
+    int centerz = 0;
+
+    //read DF map data and create MC map blocks and data arrays;
+    int threads = getThreadCount();
+    out.print ( "\nConverting Map using %d threads...\n",threads );
+    memset ( stats,0,sizeof ( stats ) );
+    std::vector<myMaterialCache> matCaches ( threads );
+    myObjectCache *objCaches = new myObjectCache[threads];
+    myResolvedMats resolvedMats;
+    myPhaseTimer resolveTimer ( exportStats.phases[PHASE_RESOLVE] );
+    resolveRaws ( out, snap, resolvedMats, threads );
+    resolveTimer.stop ( resolvedMats.mats.size() );
+    exportStats.levels.resize ( z_max );
+    memset ( &exportStats.levels[0],0,z_max*sizeof ( myPhaseTime ) );
+
+    //the map is converted, lit and saved a band of chunk columns at a time - one column of DF blocks, which is
+    //squaresize chunks wide - so only the band being converted, the one being lit and saved, and the saved one
+    //before it (which light still spreads in from) are in memory, so memory grows with the length of a band
+    //rather than with the whole area
+    int bands = y_max-yoffset;
+    int bandchunks = squaresize;
+    int64_t saveTime = 0;
+    int64_t totalsize = 0;
+    size_t peakBytes = 0;
+    int peakSections = 0;
+    myRegionSet regions;
+    int res = 0;
+    for ( int band=0;band<=bands && res==0;band++ )
+    {
+        if ( band<bands )
+        {
+            myPhaseTimer convertTimer ( exportStats.phases[PHASE_CONVERT] );
+            int64_t tiles = 0;
+            out.print ( "Band %d/%d ",band+1,bands );
+            uint32_t dfblocky = yoffset+band;
+            uint32_t zcount = 0;
+            for ( uint32_t zzz = 0; zzz< z_max;zzz++ )
+            {
+                if ( limitz[zzz]==0 )
+                    continue;
+
+                //blocks on one level only write to their own columns, so they can be converted in any order.
+                //levels stay in order as trees and sand supports reach into the levels above and below
+                myLevelJob level;
+                level.snap = &snap;
+                level.world = &world;
+                level.zzz = zzz;
+                level.zcount = zcount;
+                level.matCaches = &matCaches[0];
+                level.objCaches = objCaches;
+                level.resolved = &resolvedMats;
+                for ( uint32_t dfblockx = xoffset; dfblockx< x_max;dfblockx++ )
+                {
+                    if ( snap.getBlock ( dfblockx,dfblocky,zzz ) )
+                    {
+                        level.blockx.push_back ( dfblockx );
+                        level.blocky.push_back ( dfblocky );
+                    }
+                }
+                level.contexts.resize ( level.blockx.size() );
+
+                myPhaseTimer levelTimer ( exportStats.levels[zzz] );
+                parallelFor ( threads, ( int ) level.blockx.size(), convertLevelBlock, &level );
+
+                //merge the results in block order, so the output is the same no matter how the work was split
+                for ( size_t b=0;b<level.contexts.size();b++ )
+                {
+                    mergeContext ( out, uio, level.contexts[b] );
+                }
+                levelTimer.stop ( level.blockx.size() *SQUARESPERBLOCK*SQUARESPERBLOCK );
+                tiles += level.blockx.size() *SQUARESPERBLOCK*SQUARESPERBLOCK;
+                zcount++;
+            }
+
+            //add bottom layer of adminium
+            int x0 = band*bandchunks*16;
+            int x1 = min ( x0+bandchunks*16,mcxsquares );
+            for ( int oy=0;oy<mcysquares;oy++ )
+            {
+                for ( int ox=x0;ox<x1;ox++ )
+                {
+                    world.setBlock ( ox,oy,0,7,0 ); // bedrock / adminium
+                }
+            }
+
+            if ( cursorSpawn && cx>=x0 && cx<x1 )
+            {
                 //now check if that location is ok, or do we have to move up because it is a floor cube.
+                bool ok = false;
                 for ( int i=1;i< ( squaresize ) &&!ok;i++ )  //starting at 1 because of the one layer of adminium at the bottom of the map
                 {
                     cz = zcnt * squaresize + i;
-                    int idx = cx + ( cz * mcysquares +cy ) * mcxsquares;
-                    int idx1 = cx + ( ( cz+1 ) * mcysquares +cy ) * mcxsquares;
-
-                    if ( mclayers[idx]==0 && mclayers[idx1]==0 )
+                    if ( world.getBlock ( cx,cy,cz ) ==0 && world.getBlock ( cx,cy,cz+1 ) ==0 )
                     {
                         //if this location and one above it are air, spawn location is ok
                         ok = true;
@@ -2982,37 +5952,131 @@ int convertMaps ( color_ostream & out )
                 if ( !ok )
                 {
                     out.print ( "DF Cursor not at location with enough space for spawn\nSetting spawn to top center of area\n" );
-                    cx = -1;//never found a valid location - place in center
+                    cursorSpawn = false;
                 }
             }
-            else
+            if ( centerx>=x0 && centerx<x1 )
             {
-                out.print ( "DF Cursor outside of area output on this level\nSetting spawn to top center of area\n" );
-                cx=-1;
+                centerz = mczsquares;
+                uint8_t val = 0;
+                while ( val == 0 && centerz>0 )
+                {
+                    centerz--;
+                    val = world.getBlock ( centerx,centery,centerz );
+                };
+                centerz++;
             }
+            compactWorld ( world, band*bandchunks, min ( ( band+1 ) *bandchunks,world.chunksx ) );
+            convertTimer.stop ( tiles );
+            exportStats.tiles += tiles;
+            exportStats.voxels += tiles*squaresize*squaresize*squaresize;
         }
-        else
+
+        //the band before this one has converted world on both sides now, so it can be finished
+        if ( band>0 )
         {
-            out.print ( "DF Cursor on level not being output\nSetting spawn to top center of area\n" );
-            cx=-1;
+            int lit0 = ( band-1 ) *bandchunks;
+            int lit1 = min ( ( band+1 ) *bandchunks,world.chunksx );
+            myPhaseTimer lightTimer ( exportStats.phases[PHASE_LIGHT] );
+            calcLighting ( world, lit0, lit1 );
+            compactWorld ( world, lit0, lit1 );
+            lightTimer.stop ( ( min ( band*bandchunks,world.chunksx )-lit0 ) *world.chunksy );
+            int64_t start = getMillis();
+
+            //this is as much of the world as is ever held at once
+            peakBytes = max ( peakBytes,world.bytes() );
+            peakSections = max ( peakSections,world.allocated );
+
+            res = saveChunks ( out, dirname, world, lit0, band*bandchunks, regions, totalsize );
+            if ( band>1 )
+            {
+                for ( int x=lit0-bandchunks;x<lit0;x++ )
+                    for ( int y=0;y<world.chunksy;y++ )
+                        world.releaseChunk ( x,y );
+            }
+            saveTime += getMillis()-start;
+        }
+        out.print ( "\n" );
+    }
+
+    //print stats
+    for ( int i=0;i<STAT_AREAS;i++ )
+    {
+        switch ( i )
+        {
+        case MATERIALS:
+            out.print ( " MATERIALS:\t" );
+            break;
+        case TERRAIN:
+            out.print ( " TERRAIN:  \t" );
+            break;
+        case FLOWS:
+            out.print ( " FLOWS:    \t" );
+            break;
+        case PLANTS:
+            out.print ( " PLANTS:   \t" );
+            break;
+        case BUILDINGS:
+            out.print ( " BUILDINGS:\t" );
+            break;
+        }
+        out.print ( "unknown: %d  imperfect: %d  perfect: %d  new: %d\n",stats[i][UNKNOWN],stats[i][IMPERFECT],stats[i][PERFECT],stats[i][UNSEEN] );
+    }
+
+    double cacheHits = 0;
+    double cacheLookups = 0;
+    for ( size_t i=0;i<matCaches.size();i++ )
+    {
+        cacheHits += matCaches[i].hits;
+        cacheLookups += matCaches[i].hits + matCaches[i].misses;
+    }
+    if ( cacheLookups>0 )
+    {
+        out.print ( "Material cache: %.0f lookups, %.1f%% hits\n",cacheLookups,100.0*cacheHits/cacheLookups );
+    }
+
+    //objects are only built once for each shape and material, the rest reuse them
+    double objBuilt = 0;
+    double objReused = 0;
+    size_t objBytes = 0;
+    size_t objAllocs = 0;
+    for ( int i=0;i<threads;i++ )
+    {
+        objBuilt += objCaches[i].built;
+        objReused += objCaches[i].hits;
+        objBytes += objCaches[i].bytes;
+        objAllocs += objCaches[i].chunks.size();
+    }
+    out.print ( "Objects: %.0f built, %.0f reused, %d KB in %d allocations\n",objBuilt,objReused, ( int ) ( objBytes/1024 ), ( int ) objAllocs );
+    out.print ( "Peak memory: %d MB map (at most %d of %d sections) + %d KB objects\n",
+                ( int ) ( peakBytes / ( 1024*1024 ) ), peakSections, world.chunksx*world.chunksy*world.sectionsz, ( int ) ( objBytes/1024 ) );
+    delete[] objCaches;
+
+    if ( uio!=NULL )
+    {
+        if ( uio->GetDocument() !=NULL )
+        {
+            uio->GetDocument()->SaveFile();
+            delete uio->GetDocument();
         }
     }
-    if ( cx==30000 || cx<0 )
+
+    if ( res != 0 )
+    {
+        out.print ( "Error writing file!\n" );
+        return res;
+    }
+    out.print ( "Saved %d KB of chunks using %s compression in %.2f seconds\n", ( int ) ( totalsize/1024 ), compression->name, saveTime/1000.0 );
+
+    //the cursor location has already been checked when its column was converted
+    out.print ( "\nPlancing spawn location\n" );
+    if ( !cursorSpawn )
     {
         //need to set spawn to center of map;
         out.print ( "Putting spawn at center of map...\n" );
-        cx = mcxsquares/2;
-        cy = mcysquares/2;
-        cz = mczsquares;
-        uint8_t val = 0;
-        int pos;
-        while ( val == 0 && cz>0 )
-        {
-            cz--;
-            pos = ( cx ) + ( ( cz ) * mcysquares + cy ) * mcxsquares;
-            val = mclayers[pos];
-        };
-        cz++;
+        cx = centerx;
+        cy = centery;
+        cz = centerz;
         ocx = ( ( mcysquares - cy ) / squaresize + ( xoffset*SQUARESPERBLOCK ) );
         ocy = cx / squaresize + ( yoffset*SQUARESPERBLOCK );
         ocz = cz / squaresize;
@@ -3032,10 +6096,50 @@ int convertMaps ( color_ostream & out )
     }
     out.print ( "Putting spawn at %d,%d,%d in Minecraft\nwhich is at %d,%d,%d in Dwarf Fortress\n",cx,cy,cz,ocx,ocy,ocz );
 
-    calcLighting ( out, mclayers,mcskylight,mcblocklight, mcxsquares, mcysquares, mczsquares );
-
     //save the level!
-    return saveMCLevelAlpha ( out, mclayers, mcdata, mcskylight, mcblocklight, mcxsquares, mcysquares, mczsquares,cx,cy,cz,NULL );
+    res = saveLevelDat ( out, dirname, cx, cy, cz, totalsize );
+    if ( res==0 )
+        reportExport ( out, dirname );
+    return res;
+}
+
+int convertMaps ( color_ostream & out, const mySnapshot & snap )
+{
+    mySectionStore *store = NULL;
+    if ( swapFile )
+    {
+        store = new mySectionStore;
+        if ( store->open ( "df2mc.swap" ) )
+        {
+            out.print ( "Keeping the world in a swap file\n" );
+            sectionStore = store;
+        }
+        else
+        {
+            out.printerr ( "Unable to create swap file df2mc.swap, keeping the world in memory\n" );
+            delete store;
+            store = NULL;
+        }
+    }
+
+    int res;
+    try
+    {
+        res = convertWorld ( out, snap );
+    }
+    catch ( std::bad_alloc & )
+    {
+        if ( store )
+            out.printerr ( "\nOut of memory, the swap file could not be grown\n" );
+        else
+            out.printerr ( "\nOut of memory, try a smaller area or <swapfile val=\"1\"> in df2mc.xml\n" );
+        res = 22;
+    }
+
+    //the world has been freed by now, so the swap file can go
+    sectionStore = NULL;
+    delete store;
+    return res;
 }
 
 /*
@@ -3107,23 +6211,87 @@ DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <strin
 
 DFhackCExport command_result plugin_init (DFHack::color_ostream & c, std::vector <PluginCommand> &commands)
 {
-    commands.push_back(PluginCommand("df2minecraft", "Print the weather map or change weather.",mc_export));
+    commands.push_back(PluginCommand("df2minecraft", "Export the map to a Minecraft world, 'df2minecraft benchmark' times the chunk packing code.",mc_export));
     return CR_OK;
 }
 
+struct myExportJob
+{
+    mySnapshot *snap;
+    TiXmlDocument *doc;
+};
+
+void exportWorker ( void *arg )
+{
+    //finishes an export from a snapshot while Dwarf Fortress keeps running
+    myExportJob *job = ( myExportJob* ) arg;
+    color_ostream &out = Core::getInstance().getConsole();
+
+    int result = convertMaps ( out, *job->snap );
+
+    job->doc->SaveFile ( "hack/updated.xml" );
+
+    if ( result )
+        out.printerr ( "\nBackground export failed (%d)\n",result );
+    else
+        out.print ( "\nBackground export finished.\n" );
+
+    delete job->snap;
+    delete job->doc;
+    delete job;
+
+    setExportRunning ( false );
+}
+
 DFhackCExport command_result plugin_shutdown ( DFHack::color_ostream & c )
 {
+    if ( exportThread!=NULL )
+    {
+        if ( isExportRunning() )
+            c.print ( "Waiting for the background export to finish...\n" );
+        exportThread->join();
+        delete exportThread;
+        exportThread = NULL;
+    }
     return CR_OK;
 }
 
 DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <string> & parameters)
 {
+    if ( parameters.size() >0 && parameters[0]=="benchmark" )
+    {
+        benchmarkPacking ( c );
+        return CR_OK;
+    }
+
+    //the settings and object maps are shared with the background export
+    if ( exportThread!=NULL )
+    {
+        if ( isExportRunning() )
+        {
+            c.printerr ( "An export is still running in the background, try again when it has finished\n" );
+            return CR_FAILURE;
+        }
+        exportThread->join();
+        delete exportThread;
+        exportThread = NULL;
+    }
+
+    //the timings start afresh with every export
+    memset ( exportStats.phases,0,sizeof ( exportStats.phases ) );
+    exportStats.levels.clear();
+    exportStats.tiles = exportStats.voxels = exportStats.bytes = exportStats.helperCpu = 0;
+    exportStats.start = getMicros();
+    myPhaseTimer settingsTimer ( exportStats.phases[PHASE_SETTINGS] );
+
     //load settings xml
-    TiXmlDocument doc ( "hack/df2mc.xml" );
+    TiXmlDocument *docp = new TiXmlDocument ( "hack/df2mc.xml" );
+    TiXmlDocument &doc = *docp;
     bool loadOkay = doc.LoadFile();
     if ( !loadOkay )
     {
         c.printerr ( "Could not load hack/df2mc.xml\n" );
+        delete docp;
         return CR_FAILURE;
     }
 
@@ -3132,6 +6300,7 @@ DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <strin
     if ( settings==NULL )
     {
         c.printerr ( "Could not load settings from hack/df2mc.xml (corrupt xml file?)\n" );
+        delete docp;
         return CR_FAILURE;
     }
     squaresize=3;
@@ -3145,6 +6314,7 @@ DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <strin
     if ( res==NULL || squaresize<1 || squaresize>10 )
     {
         c.printerr ( "Invalid square size setting\n" );
+        delete docp;
         return CR_FAILURE;
     }
 
@@ -3194,6 +6364,30 @@ DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <strin
         settings->FirstChildElement ( "output" )->SetAttribute ( "seed","" );
     }
 
+    outputType = OUTPUT_ALPHA;
+    if ( stricmp ( settings->FirstChildElement ( "output" )->Attribute ( "type" ),"mcregion" ) ==0 )
+        outputType = OUTPUT_MCREGION;
+    if ( stricmp ( settings->FirstChildElement ( "output" )->Attribute ( "type" ),"anvil" ) ==0 )
+        outputType = OUTPUT_ANVIL;
+    maxHeight = outputType==OUTPUT_ANVIL ? ANVIL_HEIGHT : CHUNK_HEIGHT;
+
+    if ( settings->FirstChildElement ( "output" )->Attribute ( "compression" ) ==NULL )
+    {
+        settings->FirstChildElement ( "output" )->SetAttribute ( "compression","archival" );
+    }
+    compression = NULL;
+    for ( int i=0;compressionProfiles[i].name!=NULL;i++ )
+    {
+        if ( stricmp ( settings->FirstChildElement ( "output" )->Attribute ( "compression" ),compressionProfiles[i].name ) ==0 )
+            compression = &compressionProfiles[i];
+    }
+    if ( compression==NULL )
+    {
+        c.printerr ( "Unknown output compression '%s', using archival\n",settings->FirstChildElement ( "output" )->Attribute ( "compression" ) );
+        compression = &compressionProfiles[2];
+        settings->FirstChildElement ( "output" )->SetAttribute ( "compression","archival" );
+    }
+
     int64_t tmpseed = _atoi64 ( settings->FirstChildElement ( "output" )->Attribute ( "seed" ) );
     if ( tmpseed != 0 )
     {
@@ -3218,8 +6412,8 @@ DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <strin
     }
     if ( settings->FirstChildElement ( "directionalwalls" )->Attribute ( "val", &directionalWalls ) ==NULL )
     {
-        directionalWalls=0;
-        settings->FirstChildElement ( "directionalwalls" )->SetAttribute ( "val","0" );
+        directionalWalls=1;
+        settings->FirstChildElement ( "directionalwalls" )->SetAttribute ( "val","1" );
     }
 
     if ( settings->FirstChildElement ( "safesand" ) ==NULL )
@@ -3233,6 +6427,39 @@ DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <strin
         settings->FirstChildElement ( "safesand" )->SetAttribute ( "val","3" );
     }
 
+    if ( settings->FirstChildElement ( "background" ) ==NULL )
+    {
+        TiXmlElement * ss = new TiXmlElement ( "background" );
+        settings->LinkEndChild ( ss );
+    }
+    if ( settings->FirstChildElement ( "background" )->Attribute ( "val", &background ) ==NULL )
+    {
+        background=1;
+        settings->FirstChildElement ( "background" )->SetAttribute ( "val","1" );
+    }
+
+    if ( settings->FirstChildElement ( "threads" ) ==NULL )
+    {
+        TiXmlElement * ss = new TiXmlElement ( "threads" );
+        settings->LinkEndChild ( ss );
+    }
+    if ( settings->FirstChildElement ( "threads" )->Attribute ( "val", &numThreads ) ==NULL || numThreads<0 )
+    {
+        numThreads=0;
+        settings->FirstChildElement ( "threads" )->SetAttribute ( "val","0" );
+    }
+
+    if ( settings->FirstChildElement ( "swapfile" ) ==NULL )
+    {
+        TiXmlElement * ss = new TiXmlElement ( "swapfile" );
+        settings->LinkEndChild ( ss );
+    }
+    if ( settings->FirstChildElement ( "swapfile" )->Attribute ( "val", &swapFile ) ==NULL )
+    {
+        swapFile=0;
+        settings->FirstChildElement ( "swapfile" )->SetAttribute ( "val","0" );
+    }
+
     int temp;
     limitxmin=0;
     limitymin=0;
@@ -3274,9 +6501,9 @@ DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <strin
         }
     }
 
-    if ( ( limitlevels*squaresize ) > (CHUNK_HEIGHT-1) )
+    if ( ( limitlevels*squaresize ) > ( uint32_t ) ( maxHeight-1 ) )
     {
-        limitlevels = (CHUNK_HEIGHT-1)/squaresize;
+        limitlevels = (maxHeight-1)/squaresize;
     }
 
     //load MC material mappings
@@ -3328,12 +6555,45 @@ DFhackCExport command_result mc_export (DFHack::color_ostream & c, vector <strin
     }
 
     loadDFObjects(c);
+    c.print ( "Using %s object kernels for squaresize %d\n",selectKernels(),squaresize );
+    settingsTimer.stop();
+
+    //copy what we need out of DF - the game is only frozen while this runs
+    mySnapshot *snap = new mySnapshot;
+    int result;
+    int64_t start = getMillis();
+    {
+        CoreSuspender suspend;
+        result = snapshotDFMap ( c, *snap );
+    }
+    c.print ( "Copying the map took %.2f seconds\n", ( getMillis()-start ) /1000.0 );
+    if ( result )
+    {
+        delete snap;
+        delete docp;
+        return CR_FAILURE;
+    }
+
+    if ( background )
+    {
+        //convert, light and save on a worker thread, DF is already running again
+        c.print ( "\nMap copied, Dwarf Fortress can be used again.\nThe export will continue in the background.\n" );
+        myExportJob *job = new myExportJob;
+        job->snap = snap;
+        job->doc = docp;
+        setExportRunning ( true );
+        exportThread = new tthread::thread ( exportWorker, job );
+        return CR_OK;
+    }
 
     //convert the map
-    int result = convertMaps ( c );
+    result = convertMaps ( c, *snap );
 
     doc.SaveFile ( "hack/updated.xml" );
 
+    delete snap;
+    delete docp;
+
     if (result)
         return CR_FAILURE;
     else